@@ -0,0 +1,159 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/phicontextprivate.h"
+
+#include "phi/phidocument.h"
+#include "phi/phinodedeviceprivate.h"
+
+G_DEFINE_FINAL_TYPE(PhiContext, phi_context, G_TYPE_OBJECT)
+
+enum {
+	PROP_STORE_SIZE = 1,
+	N_PROPERTIES
+};
+static GParamSpec* obj_properties[N_PROPERTIES] = { 0, };
+
+static void phi_context_ctx_lock_lock(void* user, int lock) {
+	PhiContext* self = PHI_CONTEXT(user);
+	g_assert(lock >= 0 && lock < (gint)G_N_ELEMENTS(self->ctx_locks));
+	g_mutex_lock(&self->ctx_locks[lock]);
+}
+static void phi_context_ctx_lock_unlock(void* user, int lock) {
+	PhiContext* self = PHI_CONTEXT(user);
+	g_assert(lock >= 0 && lock < (gint)G_N_ELEMENTS(self->ctx_locks));
+	g_mutex_unlock(&self->ctx_locks[lock]);
+}
+
+static void phi_context_object_constructed(GObject* object) {
+	PhiContext* self = PHI_CONTEXT(object);
+	G_OBJECT_CLASS(phi_context_parent_class)->constructed(object);
+
+	fz_locks_context locks = {
+		.user = self,
+		.lock = phi_context_ctx_lock_lock,
+		.unlock = phi_context_ctx_lock_unlock
+	};
+	self->ctx = fz_new_context(NULL, &locks, self->store_size);
+	if (!self->ctx)
+		g_error("Failed to create MuPDF context");
+	fz_set_user_context(self->ctx, self);
+	fz_register_document_handlers(self->ctx);
+
+	// not the GTask pool, conversions themselves may run there and would deadlock waiting on it
+	self->decode_pool = g_thread_pool_new(phi_node_device_decode_job_run, NULL, g_get_num_processors(), FALSE, NULL);
+}
+
+static void phi_context_object_dispose(GObject* object) {
+	PhiContext* self = PHI_CONTEXT(object);
+	g_clear_object(&self->memory_monitor);
+	G_OBJECT_CLASS(phi_context_parent_class)->dispose(object);
+}
+
+static void phi_context_object_finalize(GObject* object) {
+	PhiContext* self = PHI_CONTEXT(object);
+	// every conversion waits for its own jobs, so the pool is idle by now
+	if (self->decode_pool)
+		g_thread_pool_free(self->decode_pool, FALSE, FALSE);
+	if (self->ctx)
+		fz_drop_context(self->ctx);
+	for (gsize i = 0; i < G_N_ELEMENTS(self->ctx_locks); i++)
+		g_mutex_clear(&self->ctx_locks[i]);
+	G_OBJECT_CLASS(phi_context_parent_class)->finalize(object);
+}
+
+static void phi_context_object_get_property(GObject* object, guint prop_id, GValue* val, GParamSpec* pspec) {
+	PhiContext* self = PHI_CONTEXT(object);
+	switch (prop_id) {
+		case PROP_STORE_SIZE:
+			g_value_set_uint64(val, phi_context_get_store_size(self));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+static void phi_context_object_set_property(GObject* object, guint prop_id, const GValue* val, GParamSpec* pspec) {
+	PhiContext* self = PHI_CONTEXT(object);
+	switch (prop_id) {
+		case PROP_STORE_SIZE:
+			self->store_size = g_value_get_uint64(val);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+
+static void phi_context_class_init(PhiContextClass* klass) {
+	GObjectClass* object_class = G_OBJECT_CLASS(klass);
+	object_class->constructed = phi_context_object_constructed;
+	object_class->dispose = phi_context_object_dispose;
+	object_class->finalize = phi_context_object_finalize;
+	object_class->get_property = phi_context_object_get_property;
+	object_class->set_property = phi_context_object_set_property;
+
+	obj_properties[PROP_STORE_SIZE] = g_param_spec_uint64("store-size", NULL, NULL, 0, G_MAXUINT64, FZ_STORE_DEFAULT, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+	g_object_class_install_properties(object_class, N_PROPERTIES, obj_properties);
+}
+
+static void phi_context_low_memory_warning(GMemoryMonitor*, GMemoryMonitorWarningLevel level, PhiContext* self) {
+	if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+		fz_empty_store(self->ctx);
+	else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+		fz_shrink_store(self->ctx, 25);
+	else
+		fz_shrink_store(self->ctx, 50);
+}
+
+static void phi_context_init(PhiContext* self) {
+	for (gsize i = 0; i < G_N_ELEMENTS(self->ctx_locks); i++)
+		g_mutex_init(&self->ctx_locks[i]);
+
+	self->ctx = NULL;
+	self->store_size = FZ_STORE_DEFAULT;
+	self->decode_pool = NULL;
+
+	self->memory_monitor = g_memory_monitor_dup_default();
+	g_signal_connect_object(self->memory_monitor, "low-memory-warning", G_CALLBACK(phi_context_low_memory_warning), self, G_CONNECT_DEFAULT);
+}
+
+PhiContext* phi_context_new(gsize store_size) {
+	return g_object_new(PHI_TYPE_CONTEXT, "store-size", (guint64)store_size, NULL);
+}
+
+static gsize phi_context_default = 0;
+
+PhiContext* phi_context_get_default(void) {
+	if (g_once_init_enter(&phi_context_default)) {
+		PhiContext* context = phi_context_new(phi_document_get_default_store_size());
+		g_once_init_leave(&phi_context_default, (gsize)context);
+	}
+	return (PhiContext*)phi_context_default;
+}
+
+gboolean phi_context_has_default(void) {
+	return g_atomic_pointer_get(&phi_context_default) != 0;
+}
+
+gsize phi_context_get_store_size(PhiContext* self) {
+	g_return_val_if_fail(PHI_IS_CONTEXT(self), 0);
+	return self->store_size;
+}
+
+fz_context* phi_context_clone(PhiContext* self) {
+	return fz_clone_context(self->ctx);
+}
@@ -0,0 +1,37 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PHICONTEXT_H__
+#define __PHICONTEXT_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define PHI_TYPE_CONTEXT (phi_context_get_type())
+G_DECLARE_FINAL_TYPE(PhiContext, phi_context, PHI, CONTEXT, GObject)
+
+PhiContext* phi_context_new(gsize store_size);
+PhiContext* phi_context_get_default(void);
+
+gsize phi_context_get_store_size(PhiContext* self);
+
+G_END_DECLS
+
+#endif // __PHICONTEXT_H__
@@ -0,0 +1,54 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PHICONTEXTPRIVATE_H__
+#define __PHICONTEXTPRIVATE_H__
+
+#include "phi/phicontext.h"
+
+#include <gio/gio.h>
+#include <mupdf/fitz.h>
+
+G_BEGIN_DECLS
+
+struct _PhiContext {
+	GObject parent_instance;
+
+	GMutex ctx_locks[FZ_LOCK_MAX];
+
+	/* Never used directly, only cloned. Clones share the store, the glyph
+	 * cache, fonts and colorspaces with it. The user context of every
+	 * clone points back at this PhiContext.
+	 */
+	fz_context* ctx;
+	gsize store_size;
+
+	// decodes images ahead of conversion for all documents, see phi_node_device_decode_images
+	GThreadPool* decode_pool;
+
+	GMemoryMonitor* memory_monitor;
+};
+
+fz_context* phi_context_clone(PhiContext* self);
+// whether phi_context_get_default has created the default context yet
+gboolean phi_context_has_default(void);
+
+G_END_DECLS
+
+#endif // __PHICONTEXTPRIVATE_H__
@@ -18,55 +18,199 @@
 
 #include "phi/phidocumentprivate.h"
 
+#include <mupdf/pdf.h>
+
+#include "phi/phicontextprivate.h"
 #include "phi/phipageprivate.h"
 #include "phi/phigiostreamprivate.h"
+#include "phi/phinodedeviceprivate.h"
+
+#define PHI_DOCUMENT_DEFAULT_NODE_CACHE_SIZE (64 * 1024 * 1024)
+#define PHI_DOCUMENT_DEFAULT_PAGE_CACHE_SIZE 16
+#define PHI_DOCUMENT_PATH_CACHE_SIZE (16 * 1024 * 1024)
+#define PHI_DOCUMENT_IMAGE_CACHE_SIZE (128 * 1024 * 1024)
 
 static void phi_document_list_model_iface_init(GListModelInterface *iface);
 G_DEFINE_FINAL_TYPE_WITH_CODE(PhiDocument, phi_document, G_TYPE_OBJECT,
 	G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, phi_document_list_model_iface_init)
 )
 
+enum {
+	PROP_CONTEXT = 1,
+	PROP_NODE_CACHE_SIZE,
+	PROP_PAGE_CACHE_SIZE,
+	N_PROPERTIES
+};
+static GParamSpec* obj_properties[N_PROPERTIES] = { 0, };
+
+enum {
+	SIGNAL_NODE_EVICTED,
+	SIGNAL_PAGE_GEOMETRY_CHANGED,
+	N_SIGNALS
+};
+static guint obj_signals[N_SIGNALS] = { 0, };
+
+// budget of the fz_store of the default context, only read when that is created
+static gsize phi_document_default_store_size = FZ_STORE_DEFAULT;
+
+static void phi_document_drop_idle_workers(PhiDocument* self) {
+	fz_context* worker;
+	while ((worker = g_async_queue_try_pop(self->render_workers)))
+		fz_drop_context(worker);
+}
+
 static void phi_document_object_finalize(GObject* object) {
 	PhiDocument* self = PHI_DOCUMENT(object);
+	if (self->render_pool)
+		g_thread_pool_free(self->render_pool, TRUE, TRUE);
+	phi_document_drop_idle_workers(self);
+	g_async_queue_unref(self->render_workers);
+	phi_lru_cache_free(self->node_cache);
+	phi_lru_cache_free(self->page_cache);
+	phi_font_cache_free(self->caches.fonts, self->ctx);
+	phi_lru_cache_free(self->caches.paths);
+	phi_lru_cache_free(self->caches.images);
+	g_free(self->geometry);
 	if (self->document)
 		fz_drop_document(self->ctx, self->document);
 	if (self->ctx)
 		fz_drop_context(self->ctx);
-	for (gsize i = 0; i < G_N_ELEMENTS(self->ctx_locks); i++)
-		g_mutex_clear(&self->ctx_locks[i]);
+	// owns the locks of ctx, so it has to go last
+	g_clear_object(&self->context);
+	if (self->mapped)
+		g_mapped_file_unref(self->mapped);
+	g_mutex_clear(&self->lock);
+	g_mutex_clear(&self->pages_lock);
 	G_OBJECT_CLASS(phi_document_parent_class)->finalize(object);
 }
 
 static void phi_document_object_dispose(GObject* object) {
 	PhiDocument* self = PHI_DOCUMENT(object);
+	g_clear_object(&self->memory_monitor);
+	// pages need the document to release their fz_page, drop them while it is still intact
+	phi_lru_cache_remove_all(self->page_cache);
 	if (self->pages) {
-		for (gint i = 0; i < self->n_pages; i++)
-			if (self->pages[i])
-				g_object_unref(self->pages[i]);
+		// pages handed out may outlive the document, they can't be rendered anymore
+		for (gint i = 0; i < self->n_pages; i++) {
+			PhiPage* page = g_weak_ref_get(&self->pages[i]);
+			if (page) {
+				phi_page_detach(page);
+				g_object_unref(page);
+			}
+			g_weak_ref_clear(&self->pages[i]);
+		}
 		g_free(self->pages);
 		self->pages = NULL;
 	}
 	G_OBJECT_CLASS(phi_document_parent_class)->dispose(object);
 }
 
+static void phi_document_object_get_property(GObject* object, guint prop_id, GValue* val, GParamSpec* pspec) {
+	PhiDocument* self = PHI_DOCUMENT(object);
+	switch (prop_id) {
+		case PROP_CONTEXT:
+			g_value_set_object(val, self->context);
+			break;
+		case PROP_NODE_CACHE_SIZE:
+			g_value_set_uint64(val, phi_document_get_node_cache_size(self));
+			break;
+		case PROP_PAGE_CACHE_SIZE:
+			g_value_set_uint(val, phi_document_get_page_cache_size(self));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+static void phi_document_object_set_property(GObject* object, guint prop_id, const GValue* val, GParamSpec* pspec) {
+	PhiDocument* self = PHI_DOCUMENT(object);
+	switch (prop_id) {
+		case PROP_CONTEXT:
+			self->context = g_value_dup_object(val);
+			if (!self->context)
+				self->context = g_object_ref(phi_context_get_default());
+			break;
+		case PROP_NODE_CACHE_SIZE:
+			phi_document_set_node_cache_size(self, g_value_get_uint64(val));
+			break;
+		case PROP_PAGE_CACHE_SIZE:
+			phi_document_set_page_cache_size(self, g_value_get_uint(val));
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+
 static void phi_document_class_init(PhiDocumentClass* klass) {
 	GObjectClass* object_class = G_OBJECT_CLASS(klass);
 	object_class->finalize = phi_document_object_finalize;
 	object_class->dispose = phi_document_object_dispose;
+	object_class->get_property = phi_document_object_get_property;
+	object_class->set_property = phi_document_object_set_property;
+
+	obj_properties[PROP_CONTEXT] = g_param_spec_object("context", NULL, NULL, PHI_TYPE_CONTEXT, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+	obj_properties[PROP_NODE_CACHE_SIZE] = g_param_spec_uint64("node-cache-size", NULL, NULL, 0, G_MAXUINT64, PHI_DOCUMENT_DEFAULT_NODE_CACHE_SIZE, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+	obj_properties[PROP_PAGE_CACHE_SIZE] = g_param_spec_uint("page-cache-size", NULL, NULL, 0, G_MAXUINT, PHI_DOCUMENT_DEFAULT_PAGE_CACHE_SIZE, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+	g_object_class_install_properties(object_class, N_PROPERTIES, obj_properties);
+
+	obj_signals[SIGNAL_NODE_EVICTED] = g_signal_new("node-evicted", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_INT);
+	obj_signals[SIGNAL_PAGE_GEOMETRY_CHANGED] = g_signal_new("page-geometry-changed", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+}
+
+static void phi_document_node_evicted(gconstpointer key, gpointer, PhiDocument* self) {
+	g_signal_emit(self, obj_signals[SIGNAL_NODE_EVICTED], 0, GPOINTER_TO_INT(key));
+}
+
+static void phi_document_low_memory_warning(GMemoryMonitor*, GMemoryMonitorWarningLevel level, PhiDocument* self) {
+	// still being loaded on a worker thread
+	if (!self->pages)
+		return;
+
+	// the fz_store is shared between documents, the PhiContext takes care of that
+	if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL) {
+		phi_lru_cache_remove_all(self->node_cache);
+		phi_lru_cache_remove_all(self->page_cache);
+		phi_font_cache_clear_glyphs(self->caches.fonts);
+		phi_lru_cache_remove_all(self->caches.paths);
+		phi_lru_cache_remove_all(self->caches.images);
+		phi_document_drop_idle_workers(self);
+	} else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM) {
+		phi_lru_cache_shrink(self->node_cache, phi_lru_cache_get_budget(self->node_cache) / 4);
+		phi_lru_cache_shrink(self->caches.paths, PHI_DOCUMENT_PATH_CACHE_SIZE / 4);
+		phi_lru_cache_shrink(self->caches.images, PHI_DOCUMENT_IMAGE_CACHE_SIZE / 4);
+	} else {
+		phi_lru_cache_shrink(self->node_cache, phi_lru_cache_get_budget(self->node_cache) / 2);
+		phi_lru_cache_shrink(self->caches.images, PHI_DOCUMENT_IMAGE_CACHE_SIZE / 2);
+	}
 }
 
 static void phi_document_init(PhiDocument* self) {
-	for (gsize i = 0; i < G_N_ELEMENTS(self->ctx_locks); i++)
-		g_mutex_init(&self->ctx_locks[i]);
+	g_mutex_init(&self->lock);
+	g_mutex_init(&self->pages_lock);
 	
+	self->context = NULL;
 	self->ctx = NULL;
 	self->document = NULL;
+	self->mapped = NULL;
 	self->n_pages = 0;
 	self->pages = NULL;
+	self->geometry = NULL;
+	self->caches.fonts = phi_font_cache_new();
+	self->caches.paths = phi_lru_cache_new(g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, (GBoxedCopyFunc)gsk_path_ref, (GDestroyNotify)gsk_path_unref, PHI_DOCUMENT_PATH_CACHE_SIZE);
+	self->caches.images = phi_lru_cache_new((GHashFunc)phi_node_device_image_key_hash, (GEqualFunc)phi_node_device_image_key_equal, (GDestroyNotify)phi_node_device_image_key_free, (GBoxedCopyFunc)gsk_render_node_ref, (GDestroyNotify)gsk_render_node_unref, PHI_DOCUMENT_IMAGE_CACHE_SIZE);
+
+	self->node_cache = phi_lru_cache_new(g_direct_hash, g_direct_equal, NULL, (GBoxedCopyFunc)gsk_render_node_ref, (GDestroyNotify)gsk_render_node_unref, PHI_DOCUMENT_DEFAULT_NODE_CACHE_SIZE);
+	phi_lru_cache_set_evict_func(self->node_cache, (PhiLruCacheEvictFunc)phi_document_node_evicted, self);
+	self->page_cache = phi_lru_cache_new(g_direct_hash, g_direct_equal, NULL, (GBoxedCopyFunc)g_object_ref, g_object_unref, PHI_DOCUMENT_DEFAULT_PAGE_CACHE_SIZE);
+
+	self->memory_monitor = g_memory_monitor_dup_default();
+	g_signal_connect_object(self->memory_monitor, "low-memory-warning", G_CALLBACK(phi_document_low_memory_warning), self, G_CONNECT_DEFAULT);
+
+	self->render_pool = NULL;
+	self->render_workers = g_async_queue_new();
 }
 
 static GType phi_document_list_model_get_item_type(GListModel*) {
-	return G_TYPE_NONE;
+	return PHI_TYPE_PAGE;
 }
 static guint phi_document_list_model_get_n_items(GListModel* list) {
 	PhiDocument* self = PHI_DOCUMENT(list);
@@ -76,17 +220,15 @@ static gpointer phi_document_list_model_get_item(GListModel* list, guint positio
 	PhiDocument* self = PHI_DOCUMENT(list);
 	if ((gint)position >= self->n_pages)
 		return NULL;
-	if (!self->pages[position]) {
-		GError* error = NULL;
-		PhiPage* page = phi_document_get_page(self, position, &error);
-		if (!page) {
-			g_critical("Failed to load page: %s", error->message);
-			g_error_free(error);
-			return NULL;
-		}
-		return g_object_ref(page);
+
+	GError* error = NULL;
+	PhiPage* page = phi_document_get_page(self, position, &error);
+	if (!page) {
+		g_critical("Failed to load page: %s", error->message);
+		g_error_free(error);
+		return NULL;
 	}
-	return g_object_ref(self->pages[position]);
+	return page;
 }
 static void phi_document_list_model_iface_init(GListModelInterface *iface) {
 	iface->get_item_type = phi_document_list_model_get_item_type;
@@ -94,88 +236,659 @@ static void phi_document_list_model_iface_init(GListModelInterface *iface) {
 	iface->get_item = phi_document_list_model_get_item;
 }
 
-static void phi_document_ctx_lock_lock(void* user, int lock) {
-	PhiDocument* self = PHI_DOCUMENT(user);
-	g_assert(lock >= 0 && lock < (gint)G_N_ELEMENTS(self->ctx_locks));
-	g_mutex_lock(&self->ctx_locks[lock]);
+/* Unlike g_main_context_invoke(), this never runs func right away, even if
+ * the calling thread could acquire context. Worker threads must never run
+ * callbacks meant for the owner of context.
+ */
+static void phi_document_dispatch(GMainContext* context, GSourceFunc func, gpointer data, GDestroyNotify notify) {
+	GSource* source = g_idle_source_new();
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	g_source_set_callback(source, func, data, notify);
+	g_source_attach(source, context);
+	g_source_unref(source);
 }
-static void phi_document_ctx_lock_unlock(void* user, int lock) {
-	PhiDocument* self = PHI_DOCUMENT(user);
-	g_assert(lock >= 0 && lock < (gint)G_N_ELEMENTS(self->ctx_locks));
-	g_mutex_unlock(&self->ctx_locks[lock]);
+
+static void phi_document_set_error(fz_context* ctx, GError** error) {
+	gint code;
+	const gchar* msg = fz_convert_error(ctx, &code);
+	g_set_error_literal(error, PHI_MU_ERROR, code, msg);
 }
 
-PhiDocument* phi_document_new_from_stream(GInputStream* stream, const gchar* magic, GError** error) {
-	PhiDocument* self = g_object_new(PHI_TYPE_DOCUMENT, NULL);
+/* Opens the document either from stream or, if it isn't NULL, directly
+ * from the memory of mapped, which the document then keeps alive.
+ * The page count is only returned in n_pages, so the caller can decide
+ * on which thread the list model gets populated.
+ */
+static gboolean phi_document_load(PhiDocument* self, GInputStream* stream, GMappedFile* mapped, const gchar* magic, GCancellable* cancellable, GFileProgressCallback progress, gpointer progress_data, gint* n_pages, GError** error) {
+	if (mapped)
+		self->mapped = g_mapped_file_ref(mapped);
 
-	fz_locks_context locks = {
-		.user = self,
-		.lock = phi_document_ctx_lock_lock,
-		.unlock = phi_document_ctx_lock_unlock
-	};
-	self->ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
-	fz_register_document_handlers(self->ctx);
+	// fonts, colorspaces and the resource store are shared with every other document of the context
+	self->ctx = phi_context_clone(self->context);
+	if (!self->ctx) {
+		g_set_error_literal(error, PHI_MU_ERROR, FZ_ERROR_SYSTEM, "Failed to clone MuPDF context");
+		return FALSE;
+	}
 	
 	// TODO: autodetect magic if it is NULL
 
 	fz_stream* wrapped_stream = NULL;
+	fz_stream* progress_stream = NULL;
+	gboolean ret = FALSE;
+	fz_var(wrapped_stream);
+	fz_var(progress_stream);
+	if (g_cancellable_set_error_if_cancelled(cancellable, error))
+		goto out;
 	fz_try(self->ctx) {
-		wrapped_stream = phi_gio_stream_wrap(self->ctx, stream);
-		self->document = fz_open_document_with_stream(self->ctx, magic, wrapped_stream);
-		self->n_pages = fz_count_pages(self->ctx, self->document);	
-	} fz_always(self->ctx) {
-		if (wrapped_stream)
-			fz_drop_stream(self->ctx, wrapped_stream);
+		if (mapped)
+			wrapped_stream = fz_open_memory(self->ctx, (const unsigned char*)g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped));
+		else
+			wrapped_stream = phi_gio_stream_wrap(self->ctx, stream);
+		/* Opening may already read all of it, e.g. when the cross reference
+		 * table has to be repaired. Without progress to report cancellation is
+		 * only checked between the steps of loading, sparing the indirection.
+		 */
+		if (progress)
+			progress_stream = phi_gio_stream_wrap_progress(self->ctx, wrapped_stream, cancellable, progress, progress_data);
+		self->document = fz_open_document_with_stream(self->ctx, magic, progress_stream ? progress_stream : wrapped_stream);
 	} fz_catch(self->ctx) {
-		gint code;
-		const gchar* msg = fz_convert_error(self->ctx, &code);
-		g_set_error_literal(error, PHI_MU_ERROR, code, msg);
-		g_object_unref(self);
-		return NULL;
+		if (!g_cancellable_set_error_if_cancelled(cancellable, error))
+			phi_document_set_error(self->ctx, error);
+		goto out;
 	}
 
-	self->pages = g_new0(PhiPage*, self->n_pages);
+	gint n_chapters = 0;
+	*n_pages = 0;
+	fz_try(self->ctx) {
+		n_chapters = fz_count_chapters(self->ctx, self->document);
+	} fz_catch(self->ctx) {
+		phi_document_set_error(self->ctx, error);
+		goto out;
+	}
+	for (gint i = 0; i < n_chapters; i++) {
+		if (g_cancellable_set_error_if_cancelled(cancellable, error))
+			goto out;
+		fz_try(self->ctx) {
+			*n_pages += fz_count_chapter_pages(self->ctx, self->document, i);
+		} fz_catch(self->ctx) {
+			if (!g_cancellable_set_error_if_cancelled(cancellable, error))
+				phi_document_set_error(self->ctx, error);
+			goto out;
+		}
+	}
+	ret = TRUE;
+
+out:
+	if (progress_stream) {
+		phi_gio_stream_finish_progress(progress_stream);
+		fz_drop_stream(self->ctx, progress_stream);
+	}
+	fz_drop_stream(self->ctx, wrapped_stream);
+	return ret;
+}
+
+static gboolean phi_document_load_file(PhiDocument* self, GFile* file, GCancellable* cancellable, GFileProgressCallback progress, gpointer progress_data, gint* n_pages, GError** error) {
+	gchar* content_type = NULL;
+	GFileInfo* info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE, G_FILE_QUERY_INFO_NONE, cancellable, NULL);
+	if (info && g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE))
+		content_type = g_strdup(g_file_info_get_content_type(info));
+	g_clear_object(&info);
+
+	gboolean ret;
+	// local files are mapped, so MuPDF can seek around without any syscalls
+	gchar* path = g_file_get_path(file);
+	GMappedFile* mapped = path ? g_mapped_file_new(path, FALSE, NULL) : NULL;
+	g_free(path);
+	if (mapped) {
+		ret = phi_document_load(self, NULL, mapped, content_type, cancellable, progress, progress_data, n_pages, error);
+		g_mapped_file_unref(mapped);
+	} else {
+		GFileInputStream* stream = g_file_read(file, cancellable, error);
+		if (stream) {
+			ret = phi_document_load(self, G_INPUT_STREAM(stream), NULL, content_type, cancellable, progress, progress_data, n_pages, error);
+			g_object_unref(stream);
+		} else {
+			ret = FALSE;
+		}
+	}
+
+	g_free(content_type);
+	return ret;
+}
+
+static void phi_document_set_n_pages(PhiDocument* self, gint n_pages) {
+	self->n_pages = n_pages;
+	self->pages = g_new0(GWeakRef, self->n_pages);
+	for (gint i = 0; i < self->n_pages; i++)
+		g_weak_ref_init(&self->pages[i], NULL);
 	g_list_model_items_changed(G_LIST_MODEL(self), 0, 0, self->n_pages);
+}
+
+gsize phi_document_get_default_store_size(void) {
+	return phi_document_default_store_size;
+}
+
+void phi_document_set_default_store_size(gsize size) {
+	// MuPDF fixes the budget of a store when creating it
+	if (phi_context_has_default())
+		g_warning("The default context already exists, its store size of %" G_GSIZE_FORMAT " bytes won't change", phi_context_get_store_size(phi_context_get_default()));
+	phi_document_default_store_size = size;
+}
+
+PhiDocument* phi_document_new_from_stream(GInputStream* stream, const gchar* magic, GError** error) {
+	return phi_document_new_from_stream_with_context(NULL, stream, magic, error);
+}
+
+PhiDocument* phi_document_new_from_stream_with_context(PhiContext* context, GInputStream* stream, const gchar* magic, GError** error) {
+	g_return_val_if_fail(context == NULL || PHI_IS_CONTEXT(context), NULL);
+	PhiDocument* self = g_object_new(PHI_TYPE_DOCUMENT, "context", context, NULL);
+	gint n_pages;
+	if (!phi_document_load(self, stream, NULL, magic, NULL, NULL, NULL, &n_pages, error)) {
+		g_object_unref(self);
+		return NULL;
+	}
+	phi_document_set_n_pages(self, n_pages);
 	return self;
 }
 
 PhiDocument* phi_document_new_from_file(GFile* file, GError** error) {
-	const gchar* content_type = NULL;
-	GFileInfo* info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE, G_FILE_QUERY_INFO_NONE, NULL, NULL);
-	if (info && g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE))
-		content_type = g_file_info_get_content_type(info);
+	return phi_document_new_from_file_with_context(NULL, file, error);
+}
 
-	GFileInputStream* stream = g_file_read(file, NULL, error);
-	if (!stream)
+PhiDocument* phi_document_new_from_file_with_context(PhiContext* context, GFile* file, GError** error) {
+	g_return_val_if_fail(context == NULL || PHI_IS_CONTEXT(context), NULL);
+	PhiDocument* self = g_object_new(PHI_TYPE_DOCUMENT, "context", context, NULL);
+	gint n_pages;
+	if (!phi_document_load_file(self, file, NULL, NULL, NULL, &n_pages, error)) {
+		g_object_unref(self);
 		return NULL;
+	}
+	phi_document_set_n_pages(self, n_pages);
+	return self;
+}
 
-	PhiDocument* ret = phi_document_new_from_stream(G_INPUT_STREAM(stream), content_type, error);
+typedef struct {
+	GFile* file;
+	GMainContext* context;
+	GFileProgressCallback progress_callback;
+	gpointer progress_data;
+	gint n_pages;
+} PhiDocumentLoadData;
 
-	g_object_unref(stream);
-	if (info)
-		g_object_unref(info);
-	return ret;
+static void phi_document_load_data_free(PhiDocumentLoadData* self) {
+	g_object_unref(self->file);
+	g_main_context_unref(self->context);
+	g_free(self);
+}
+
+typedef struct {
+	GFileProgressCallback callback;
+	gpointer data;
+	goffset current;
+	goffset total;
+} PhiDocumentLoadProgress;
+
+static gboolean phi_document_load_progress_dispatch(PhiDocumentLoadProgress* progress) {
+	progress->callback(progress->current, progress->total, progress->data);
+	return G_SOURCE_REMOVE;
+}
+
+static void phi_document_load_progress(goffset current, goffset total, PhiDocumentLoadData* data) {
+	PhiDocumentLoadProgress* progress = g_new(PhiDocumentLoadProgress, 1);
+	progress->callback = data->progress_callback;
+	progress->data = data->progress_data;
+	progress->current = current;
+	progress->total = total;
+	phi_document_dispatch(data->context, (GSourceFunc)phi_document_load_progress_dispatch, progress, g_free);
+}
+
+static void phi_document_load_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	PhiDocument* self = PHI_DOCUMENT(source_object);
+	PhiDocumentLoadData* data = task_data;
+
+	GError* error = NULL;
+	if (!phi_document_load_file(self, data->file, cancellable,
+	                            data->progress_callback ? (GFileProgressCallback)phi_document_load_progress : NULL, data,
+	                            &data->n_pages, &error)) {
+		g_task_return_error(task, error);
+		return;
+	}
+	g_task_return_boolean(task, TRUE);
+}
+
+// Runs on the callers main context, so the list model only ever changes there
+static void phi_document_load_ready(GObject* source, GAsyncResult* res, gpointer user_data) {
+	PhiDocument* self = PHI_DOCUMENT(source);
+	GTask* task = G_TASK(user_data);
+
+	GError* error = NULL;
+	if (!g_task_propagate_boolean(G_TASK(res), &error)) {
+		g_task_return_error(task, error);
+	} else {
+		PhiDocumentLoadData* data = g_task_get_task_data(G_TASK(res));
+		phi_document_set_n_pages(self, data->n_pages);
+		g_task_return_pointer(task, g_object_ref(self), g_object_unref);
+	}
+	g_object_unref(task);
+}
+
+void phi_document_new_from_file_async(GFile* file, GCancellable* cancellable, GFileProgressCallback progress_callback, gpointer progress_data, GAsyncReadyCallback callback, gpointer user_data) {
+	g_return_if_fail(G_IS_FILE(file));
+
+	GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+	g_task_set_source_tag(task, phi_document_new_from_file_async);
+
+	PhiDocument* self = g_object_new(PHI_TYPE_DOCUMENT, NULL);
+	GTask* load = g_task_new(self, cancellable, phi_document_load_ready, task);
+	g_task_set_source_tag(load, phi_document_load_thread);
+
+	PhiDocumentLoadData* data = g_new0(PhiDocumentLoadData, 1);
+	data->file = g_object_ref(file);
+	data->context = g_main_context_ref_thread_default();
+	data->progress_callback = progress_callback;
+	data->progress_data = progress_data;
+	g_task_set_task_data(load, data, (GDestroyNotify)phi_document_load_data_free);
+
+	g_task_run_in_thread(load, phi_document_load_thread);
+	g_object_unref(load);
+	g_object_unref(self);
+}
+
+PhiDocument* phi_document_new_from_file_finish(GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(g_task_is_valid(result, NULL), NULL);
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+PhiContext* phi_document_get_context(PhiDocument* self) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT(self), NULL);
+	return self->context;
 }
 
 PhiPage* phi_document_get_page(PhiDocument* self, gint pageno, GError** error) {
 	g_return_val_if_fail(PHI_IS_DOCUMENT(self), NULL);
 	g_return_val_if_fail(pageno >= 0 && pageno < self->n_pages, NULL);
 
-	if (self->pages[pageno])
-		return self->pages[pageno];
+	g_mutex_lock(&self->pages_lock);
+	PhiPage* cpage = g_weak_ref_get(&self->pages[pageno]);
+	if (cpage) {
+		// refresh its position in the cache, or bring it back if it was evicted while in use
+		phi_lru_cache_insert(self->page_cache, GINT_TO_POINTER(pageno), g_object_ref(cpage), 1);
+		g_mutex_unlock(&self->pages_lock);
+		return cpage;
+	}
 	
 	fz_page* page = NULL;
+	g_mutex_lock(&self->lock);
 	fz_try(self->ctx) {
 		page = fz_load_page(self->ctx, self->document, pageno);
+	} fz_always(self->ctx) {
+		g_mutex_unlock(&self->lock);
 	} fz_catch(self->ctx) {
+		g_mutex_unlock(&self->pages_lock);
 		g_set_error_literal(error, PHI_MU_ERROR, fz_caught(self->ctx), fz_caught_message(self->ctx));
 		return NULL;
 	}
 																						  
-	PhiPage* cpage = g_object_new(PHI_TYPE_PAGE, NULL);
+	cpage = g_object_new(PHI_TYPE_PAGE, NULL);
 	cpage->document = self;
 	g_object_add_weak_pointer(G_OBJECT(self), (gpointer*)&cpage->document);
 	cpage->page = page;
-	self->pages[pageno] = cpage; // transfers ownership
+	cpage->index = pageno;
+	g_weak_ref_set(&self->pages[pageno], cpage);
+	phi_lru_cache_insert(self->page_cache, GINT_TO_POINTER(pageno), g_object_ref(cpage), 1);
+	g_mutex_unlock(&self->pages_lock);
 	return cpage;
 }
+
+guint phi_document_get_page_cache_size(PhiDocument* self) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT(self), 0);
+	return phi_lru_cache_get_budget(self->page_cache);
+}
+
+void phi_document_set_page_cache_size(PhiDocument* self, guint size) {
+	g_return_if_fail(PHI_IS_DOCUMENT(self));
+	phi_lru_cache_set_budget(self->page_cache, size);
+	g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_PAGE_CACHE_SIZE]);
+}
+
+// US Letter, for pages that fail to load before any other page is known
+static const PhiPageGeometry phi_document_fallback_geometry = {
+	.bounds = { .origin = { 0.f, 0.f }, .size = { 612.f, 792.f } },
+	.rotation = 0,
+	.user_unit = 1.f,
+};
+
+// Must be called with the document lock held, may throw
+static void phi_document_page_geometry_generic(PhiDocument* self, fz_context* ctx, gint pageno, PhiPageGeometry* geometry) {
+	fz_page* page = fz_load_page(ctx, self->document, pageno);
+	fz_rect rect;
+	fz_try(ctx) {
+		rect = fz_bound_page(ctx, page);
+	} fz_always(ctx) {
+		fz_drop_page(ctx, page);
+	} fz_catch(ctx) {
+		fz_rethrow(ctx);
+	}
+	graphene_rect_init(&geometry->bounds, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+	geometry->rotation = 0;
+	geometry->user_unit = 1.f;
+}
+
+/* Must be called with the document lock held, may throw
+ * This reads the inheritable page attributes straight from the page tree,
+ * which is a lot cheaper than loading the page with all its resources.
+ */
+static void phi_document_page_geometry_pdf(fz_context* ctx, pdf_document* pdf, gint pageno, PhiPageGeometry* geometry) {
+	pdf_obj* obj = pdf_lookup_page_obj(ctx, pdf, pageno);
+
+	fz_rect box;
+	fz_matrix ctm;
+	pdf_page_obj_transform(ctx, obj, &box, &ctm);
+	fz_rect rect = fz_transform_rect(box, ctm);
+	graphene_rect_init(&geometry->bounds, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+
+	gint rotation = pdf_to_int(ctx, pdf_dict_get_inheritable(ctx, obj, PDF_NAME(Rotate)));
+	geometry->rotation = ((rotation % 360) + 360) % 360;
+
+	pdf_obj* user_unit = pdf_dict_get(ctx, obj, PDF_NAME(UserUnit));
+	geometry->user_unit = pdf_is_number(ctx, user_unit) ? pdf_to_real(ctx, user_unit) : 1.f;
+}
+
+/* Takes the document lock for this page only, so renders interleave with
+ * long runs of pages. A page that fails keeps what geometry held before.
+ */
+static void phi_document_page_geometry(PhiDocument* self, fz_context* ctx, gint pageno, PhiPageGeometry* geometry) {
+	g_mutex_lock(&self->lock);
+	fz_try(ctx) {
+		pdf_document* pdf = pdf_specifics(ctx, self->document);
+		if (pdf)
+			phi_document_page_geometry_pdf(ctx, pdf, pageno, geometry);
+		else
+			phi_document_page_geometry_generic(self, ctx, pageno, geometry);
+	} fz_always(ctx) {
+		g_mutex_unlock(&self->lock);
+	} fz_catch(ctx) {
+		// a single broken page shouldn't prevent laying out the others
+		g_warning("Failed to get geometry of page %d: %s", pageno, fz_caught_message(ctx));
+	}
+}
+
+static void phi_document_page_geometry_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable*) {
+	PhiDocument* self = PHI_DOCUMENT(source_object);
+	PhiPageGeometry* geometry = task_data;
+
+	fz_context* ctx = fz_clone_context(self->ctx);
+	if (!ctx) {
+		g_free(geometry);
+		g_task_return_new_error(task, PHI_MU_ERROR, FZ_ERROR_SYSTEM, "Failed to clone context");
+		return;
+	}
+	for (gint i = 1; i < self->n_pages; i++) {
+		geometry[i] = geometry[i - 1];
+		phi_document_page_geometry(self, ctx, i, &geometry[i]);
+	}
+	fz_drop_context(ctx);
+
+	g_task_return_pointer(task, geometry, g_free);
+}
+
+static void phi_document_page_geometry_computed(PhiDocument* self, GAsyncResult* result, gpointer) {
+	GError* error = NULL;
+	PhiPageGeometry* geometry = g_task_propagate_pointer(G_TASK(result), &error);
+	if (!geometry) {
+		// the placeholders stay in place
+		g_warning("Failed to get page geometry: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	g_mutex_lock(&self->pages_lock);
+	PhiPageGeometry* old = self->geometry;
+	self->geometry = geometry;
+	g_mutex_unlock(&self->pages_lock);
+	g_free(old);
+
+	g_signal_emit(self, obj_signals[SIGNAL_PAGE_GEOMETRY_CHANGED], 0);
+}
+
+/* PDFs read the geometry of all pages from the page tree right away. Other
+ * formats have to load every page for that, so only the first one is, all
+ * others take its geometry until a worker has loaded them and
+ * page-geometry-changed is emitted on the thread-default main context of
+ * the first call.
+ */
+const PhiPageGeometry* phi_document_get_page_geometry(PhiDocument* self, gsize* n_pages) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT(self), NULL);
+
+	if (n_pages)
+		*n_pages = self->n_pages;
+
+	g_mutex_lock(&self->pages_lock);
+	PhiPageGeometry* ret = self->geometry;
+	g_mutex_unlock(&self->pages_lock);
+	if (ret || self->n_pages == 0)
+		return ret;
+
+	g_mutex_lock(&self->lock);
+	gboolean is_pdf = pdf_specifics(self->ctx, self->document) != NULL;
+	g_mutex_unlock(&self->lock);
+
+	PhiPageGeometry* geometry = g_new(PhiPageGeometry, self->n_pages);
+	geometry[0] = phi_document_fallback_geometry;
+	phi_document_page_geometry(self, self->ctx, 0, &geometry[0]);
+	for (gint i = 1; i < self->n_pages; i++) {
+		geometry[i] = geometry[i - 1];
+		if (is_pdf)
+			phi_document_page_geometry(self, self->ctx, i, &geometry[i]);
+	}
+
+	g_mutex_lock(&self->pages_lock);
+	gboolean lost = self->geometry != NULL;
+	if (lost)
+		ret = self->geometry;
+	else
+		ret = self->geometry = geometry;
+	g_mutex_unlock(&self->pages_lock);
+
+	if (lost) {
+		g_free(geometry);
+	} else if (!is_pdf && self->n_pages > 1) {
+		GTask* task = g_task_new(self, NULL, (GAsyncReadyCallback)phi_document_page_geometry_computed, NULL);
+		g_task_set_source_tag(task, phi_document_get_page_geometry);
+		// owned by the thread, which returns it
+		g_task_set_task_data(task, g_memdup2(geometry, sizeof *geometry * self->n_pages), NULL);
+		g_task_run_in_thread(task, phi_document_page_geometry_thread);
+		g_object_unref(task);
+	}
+	return ret;
+}
+
+GskRenderNode* phi_document_lookup_node(PhiDocument* self, gint pageno) {
+	return phi_lru_cache_lookup(self->node_cache, GINT_TO_POINTER(pageno));
+}
+
+void phi_document_cache_node(PhiDocument* self, gint pageno, GskRenderNode* node) {
+	phi_lru_cache_insert(self->node_cache, GINT_TO_POINTER(pageno), gsk_render_node_ref(node), phi_node_device_estimate_size(node));
+}
+
+guint64 phi_document_get_node_cache_size(PhiDocument* self) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT(self), 0);
+	return phi_lru_cache_get_budget(self->node_cache);
+}
+
+void phi_document_set_node_cache_size(PhiDocument* self, guint64 size) {
+	g_return_if_fail(PHI_IS_DOCUMENT(self));
+	phi_lru_cache_set_budget(self->node_cache, size);
+	g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_NODE_CACHE_SIZE]);
+}
+
+static fz_context* phi_document_acquire_worker(PhiDocument* self) {
+	fz_context* worker = g_async_queue_try_pop(self->render_workers);
+	if (worker)
+		return worker;
+	return phi_context_clone(self->context);
+}
+
+static void phi_document_release_worker(PhiDocument* self, fz_context* worker) {
+	g_async_queue_push(self->render_workers, worker);
+}
+
+/* Pages are converted through their display lists on the shared document.
+ * Recording a display list interprets the page under the document lock,
+ * so pages seen for the first time are interpreted one after another.
+ * Only replaying the lists, decoding images and building the nodes runs
+ * on every worker at once, sharing the fonts and images of the document.
+ */
+static GskRenderNode* phi_document_worker_render(PhiDocument* self, fz_context* worker, gint pageno, fz_cookie* cookie, GError** error) {
+	PhiPage* page = phi_document_get_page(self, pageno, error);
+	if (!page)
+		return NULL;
+	GskRenderNode* ret = phi_page_render_to_node_with_context(page, worker, NULL, cookie, error);
+	g_object_unref(page);
+	return ret;
+}
+
+typedef struct {
+	GMainContext* context;
+	gint first;
+	PhiDocumentRenderFlags flags;
+	PhiDocumentPageRenderedFunc page_callback;
+	gpointer page_data;
+	GDestroyNotify page_data_destroy;
+
+	// one per page, so workers don't share the progress counters
+	fz_cookie* cookies;
+	gint n_cookies;
+	GCancellable* cancellable;
+	gulong cancelled_id;
+
+	// only touched on context
+	gint pending;
+} PhiDocumentRangeData;
+
+static void phi_document_range_data_free(PhiDocumentRangeData* self) {
+	if (self->cancelled_id)
+		g_cancellable_disconnect(self->cancellable, self->cancelled_id);
+	g_clear_object(&self->cancellable);
+	if (self->page_data_destroy)
+		self->page_data_destroy(self->page_data);
+	g_free(self->cookies);
+	g_main_context_unref(self->context);
+	g_free(self);
+}
+
+static void phi_document_range_cancelled(GCancellable*, PhiDocumentRangeData* data) {
+	for (gint i = 0; i < data->n_cookies; i++)
+		data->cookies[i].abort = 1;
+}
+
+typedef struct {
+	GTask* task;
+	gint pageno;
+	gboolean cached;
+	GskRenderNode* node;
+	GError* error;
+} PhiDocumentRenderJob;
+
+static void phi_document_render_job_free(PhiDocumentRenderJob* job) {
+	if (job->node)
+		gsk_render_node_unref(job->node);
+	g_clear_error(&job->error);
+	g_object_unref(job->task);
+	g_free(job);
+}
+
+// Runs on the callers main context, so results are delivered in completion order on its thread
+static gboolean phi_document_render_job_done(PhiDocumentRenderJob* job) {
+	PhiDocument* self = PHI_DOCUMENT(g_task_get_source_object(job->task));
+	PhiDocumentRangeData* data = g_task_get_task_data(job->task);
+
+	if (!g_cancellable_is_cancelled(data->cancellable)) {
+		if (job->node && !job->cached && !(data->flags & PHI_DOCUMENT_RENDER_FLAGS_NO_CACHE))
+			phi_document_cache_node(self, job->pageno, job->node);
+		if (data->page_callback)
+			data->page_callback(self, job->pageno, job->node, job->error, data->page_data);
+	}
+
+	if (--data->pending == 0) {
+		if (!g_task_return_error_if_cancelled(job->task))
+			g_task_return_boolean(job->task, TRUE);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void phi_document_render_job_run(PhiDocumentRenderJob* job, PhiDocument* self) {
+	PhiDocumentRangeData* data = g_task_get_task_data(job->task);
+
+	if (g_cancellable_is_cancelled(data->cancellable))
+		goto done;
+
+	if (!(data->flags & PHI_DOCUMENT_RENDER_FLAGS_NO_CACHE)) {
+		job->node = phi_document_lookup_node(self, job->pageno);
+		if (job->node) {
+			job->cached = TRUE;
+			goto done;
+		}
+	}
+
+	fz_context* worker = phi_document_acquire_worker(self);
+	if (!worker) {
+		g_set_error_literal(&job->error, PHI_MU_ERROR, FZ_ERROR_SYSTEM, "Failed to clone context");
+		goto done;
+	}
+	job->node = phi_document_worker_render(self, worker, job->pageno, &data->cookies[job->pageno - data->first], &job->error);
+	phi_document_release_worker(self, worker);
+
+done:
+	phi_document_dispatch(data->context, (GSourceFunc)phi_document_render_job_done, job, (GDestroyNotify)phi_document_render_job_free);
+}
+
+void phi_document_render_range_async(PhiDocument* self, gint first, gint last, PhiDocumentRenderFlags flags, GCancellable* cancellable, PhiDocumentPageRenderedFunc page_callback, gpointer page_data, GDestroyNotify page_data_destroy, GAsyncReadyCallback callback, gpointer user_data) {
+	g_return_if_fail(PHI_IS_DOCUMENT(self));
+	g_return_if_fail(first >= 0 && first <= last && last < self->n_pages);
+
+	GTask* task = g_task_new(self, cancellable, callback, user_data);
+	g_task_set_source_tag(task, phi_document_render_range_async);
+
+	PhiDocumentRangeData* data = g_new0(PhiDocumentRangeData, 1);
+	data->context = g_main_context_ref_thread_default();
+	data->first = first;
+	data->flags = flags;
+	data->page_callback = page_callback;
+	data->page_data = page_data;
+	data->page_data_destroy = page_data_destroy;
+	data->n_cookies = last - first + 1;
+	data->cookies = g_new0(fz_cookie, data->n_cookies);
+	data->pending = data->n_cookies;
+	g_task_set_task_data(task, data, (GDestroyNotify)phi_document_range_data_free);
+
+	if (cancellable) {
+		data->cancellable = g_object_ref(cancellable);
+		data->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(phi_document_range_cancelled), data, NULL);
+	}
+
+	if (!self->render_pool) {
+		GError* error = NULL;
+		// the workers are CPU bound, more threads than cores would only contend
+		self->render_pool = g_thread_pool_new((GFunc)phi_document_render_job_run, self, g_get_num_processors(), FALSE, &error);
+		if (!self->render_pool) {
+			g_task_return_error(task, error);
+			g_object_unref(task);
+			return;
+		}
+	}
+
+	for (gint i = first; i <= last; i++) {
+		PhiDocumentRenderJob* job = g_new0(PhiDocumentRenderJob, 1);
+		job->task = g_object_ref(task);
+		job->pageno = i;
+		g_thread_pool_push(self->render_pool, job, NULL);
+	}
+	g_object_unref(task);
+}
+
+gboolean phi_document_render_range_finish(PhiDocument* self, GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT(self), FALSE);
+	g_return_val_if_fail(g_task_is_valid(result, self), FALSE);
+	return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -22,18 +22,63 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include <phi/phicontext.h>
 #include <phi/phierrors.h>
 #include <phi/phipage.h>
 
 G_BEGIN_DECLS
 
+typedef struct {
+	graphene_rect_t bounds;
+	gint rotation;
+	gfloat user_unit;
+} PhiPageGeometry;
+
+typedef enum {
+	PHI_DOCUMENT_RENDER_FLAGS_NONE = 0,
+	// neither use nor fill the node cache, e.g. when indexing a whole document
+	PHI_DOCUMENT_RENDER_FLAGS_NO_CACHE = 1 << 0,
+} PhiDocumentRenderFlags;
+
 #define PHI_TYPE_DOCUMENT (phi_document_get_type())
 G_DECLARE_FINAL_TYPE(PhiDocument, phi_document, PHI, DOCUMENT, GObject)
 
+typedef void (*PhiDocumentPageRenderedFunc)(PhiDocument* document, gint pageno, GskRenderNode* node, const GError* error, gpointer user_data);
+
+/* Budget of the fz_store of the default context, only read when that is
+ * created by the first document opened without an explicit context.
+ * Setting it afterwards has no effect on that context and warns.
+ */
+gsize phi_document_get_default_store_size(void);
+void phi_document_set_default_store_size(gsize size);
+
 PhiDocument* phi_document_new_from_stream(GInputStream* stream, const gchar* magic, GError** error);
 PhiDocument* phi_document_new_from_file(GFile* file, GError** error);
+PhiDocument* phi_document_new_from_stream_with_context(PhiContext* context, GInputStream* stream, const gchar* magic, GError** error);
+PhiDocument* phi_document_new_from_file_with_context(PhiContext* context, GFile* file, GError** error);
+// progress_callback is called on the callers main context with the bytes of file read so far
+void phi_document_new_from_file_async(GFile* file, GCancellable* cancellable, GFileProgressCallback progress_callback, gpointer progress_data, GAsyncReadyCallback callback, gpointer user_data);
+PhiDocument* phi_document_new_from_file_finish(GAsyncResult* result, GError** error);
+
+PhiContext* phi_document_get_context(PhiDocument* self);
 
+/* Returns a new reference. The page may outlive the document, but once
+ * the document is disposed it is detached and can't be rendered anymore.
+ */
 PhiPage* phi_document_get_page(PhiDocument* self, gint pageno, GError** error);
+/* Pages that aren't known yet take the geometry of the first page, the
+ * array is replaced and stays valid until page-geometry-changed.
+ */
+const PhiPageGeometry* phi_document_get_page_geometry(PhiDocument* self, gsize* n_pages);
+
+void phi_document_render_range_async(PhiDocument* self, gint first, gint last, PhiDocumentRenderFlags flags, GCancellable* cancellable, PhiDocumentPageRenderedFunc page_callback, gpointer page_data, GDestroyNotify page_data_destroy, GAsyncReadyCallback callback, gpointer user_data);
+gboolean phi_document_render_range_finish(PhiDocument* self, GAsyncResult* result, GError** error);
+
+guint phi_document_get_page_cache_size(PhiDocument* self);
+void phi_document_set_page_cache_size(PhiDocument* self, guint size);
+
+guint64 phi_document_get_node_cache_size(PhiDocument* self);
+void phi_document_set_node_cache_size(PhiDocument* self, guint64 size);
 
 G_END_DECLS
 
@@ -23,20 +23,51 @@
 
 #include <mupdf/fitz.h>
 
+#include "phi/philrucacheprivate.h"
+#include "phi/phinodedeviceprivate.h"
+
 G_BEGIN_DECLS
 
 struct _PhiDocument {
 	GObject parent_instance;
 	
-	GMutex ctx_locks[FZ_LOCK_MAX];
+	PhiContext* context;
+	// fz_document isn't thread safe, only one context may use it at a time
+	GMutex lock;
 
+	// cloned from context
 	fz_context* ctx;
 	fz_document* document;
+	// backs the documents stream when opened from a local file, must outlive document
+	GMappedFile* mapped;
 	
 	gint n_pages;
-	PhiPage** pages;
+	// guards pages and page_cache, must be taken before lock
+	GMutex pages_lock;
+	// every page that is still alive
+	GWeakRef* pages;
+	// PhiLruCache<page index, PhiPage>, keeps the most recently used pages alive
+	PhiLruCache* page_cache;
+	// built lazily, n_pages entries
+	PhiPageGeometry* geometry;
+
+	// resources shared by the node devices of all pages
+	PhiNodeDeviceCaches caches;
+
+	// PhiLruCache<page index, GskRenderNode>
+	PhiLruCache* node_cache;
+
+	GMemoryMonitor* memory_monitor;
+
+	// created on first use by phi_document_render_range_async
+	GThreadPool* render_pool;
+	// fz_context cloned from ctx that aren't used by any thread of render_pool
+	GAsyncQueue* render_workers;
 };
 
+GskRenderNode* phi_document_lookup_node(PhiDocument* self, gint pageno);
+void phi_document_cache_node(PhiDocument* self, gint pageno, GskRenderNode* node);
+
 G_END_DECLS
 
 #endif // __PHIDOCUMENTPRIVATE_H__
@@ -0,0 +1,517 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/phidocumentview.h"
+
+#include <math.h>
+
+// gap around pages, in document units
+#define PHI_DOCUMENT_VIEW_PAGE_SPACING 8.
+// pages within this many viewport heights around the visible area are converted ahead of time
+#define PHI_DOCUMENT_VIEW_PREFETCH 1.
+
+typedef struct {
+	GskRenderNode* node;
+	// set while a render of the page is in flight
+	GCancellable* cancellable;
+} PhiDocumentViewSlot;
+
+static void phi_document_view_slot_release(PhiDocumentViewSlot* slot) {
+	if (slot->cancellable) {
+		g_cancellable_cancel(slot->cancellable);
+		g_clear_object(&slot->cancellable);
+	}
+	g_clear_pointer(&slot->node, gsk_render_node_unref);
+}
+
+struct _PhiDocumentView {
+	GtkWidget parent_instance;
+
+	PhiDocument* document;
+	gulong items_changed_id;
+	gulong page_geometry_changed_id;
+
+	gdouble zoom;
+
+	GtkAdjustment* hadjustment;
+	GtkAdjustment* vadjustment;
+	GtkScrollablePolicy hscroll_policy;
+	GtkScrollablePolicy vscroll_policy;
+
+	// layout in document units, offsets[i] is the top edge of page i
+	guint n_pages;
+	graphene_rect_t* bounds;
+	gdouble* offsets;
+	gdouble layout_width;
+	gdouble layout_height;
+
+	PhiDocumentViewSlot* slots;
+	// only pages in [active_first, active_last) hold a node or a pending render
+	guint active_first;
+	guint active_last;
+};
+
+G_DEFINE_FINAL_TYPE_WITH_CODE (PhiDocumentView, phi_document_view, GTK_TYPE_WIDGET,
+	G_IMPLEMENT_INTERFACE(GTK_TYPE_SCROLLABLE, NULL)
+)
+
+enum {
+	PROP_DOCUMENT = 1,
+	PROP_ZOOM,
+	N_PROPERTIES,
+
+	PROP_HADJUSTMENT = N_PROPERTIES,
+	PROP_VADJUSTMENT,
+	PROP_HSCROLL_POLICY,
+	PROP_VSCROLL_POLICY
+};
+static GParamSpec* obj_properties[N_PROPERTIES] = { 0, };
+
+static void phi_document_view_clear_layout(PhiDocumentView* self) {
+	for (guint i = self->active_first; i < self->active_last; i++)
+		phi_document_view_slot_release(&self->slots[i]);
+	g_clear_pointer(&self->slots, g_free);
+	g_clear_pointer(&self->bounds, g_free);
+	g_clear_pointer(&self->offsets, g_free);
+	self->n_pages = 0;
+	self->layout_width = 0.;
+	self->layout_height = 0.;
+	self->active_first = 0;
+	self->active_last = 0;
+}
+
+static void phi_document_view_build_layout(PhiDocumentView* self) {
+	phi_document_view_clear_layout(self);
+	if (!self->document)
+		return;
+
+	gsize n_pages;
+	const PhiPageGeometry* geometry = phi_document_get_page_geometry(self->document, &n_pages);
+	self->n_pages = n_pages;
+	self->bounds = g_new0(graphene_rect_t, self->n_pages);
+	self->offsets = g_new0(gdouble, self->n_pages);
+	self->slots = g_new0(PhiDocumentViewSlot, self->n_pages);
+
+	gdouble y = PHI_DOCUMENT_VIEW_PAGE_SPACING;
+	gdouble width = 0.;
+	for (guint i = 0; i < self->n_pages; i++) {
+		self->bounds[i] = geometry[i].bounds;
+		self->offsets[i] = y;
+		y += self->bounds[i].size.height + PHI_DOCUMENT_VIEW_PAGE_SPACING;
+		width = MAX(width, self->bounds[i].size.width);
+	}
+	self->layout_width = width + 2 * PHI_DOCUMENT_VIEW_PAGE_SPACING;
+	self->layout_height = y;
+}
+
+static void phi_document_view_configure_adjustment(GtkAdjustment* adjustment, gdouble content, gdouble viewport) {
+	gdouble upper = MAX(content, viewport);
+	gtk_adjustment_configure(adjustment,
+		CLAMP(gtk_adjustment_get_value(adjustment), 0., upper - viewport),
+		0., upper,
+		viewport * .1, viewport * .9, viewport
+	);
+}
+
+static void phi_document_view_configure_adjustments(PhiDocumentView* self) {
+	if (self->hadjustment)
+		phi_document_view_configure_adjustment(self->hadjustment, self->layout_width * self->zoom, gtk_widget_get_width(GTK_WIDGET(self)));
+	if (self->vadjustment)
+		phi_document_view_configure_adjustment(self->vadjustment, self->layout_height * self->zoom, gtk_widget_get_height(GTK_WIDGET(self)));
+}
+
+// index of the first page whose bottom edge is below y
+static guint phi_document_view_first_page_ending_after(PhiDocumentView* self, gdouble y) {
+	guint lo = 0, hi = self->n_pages;
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (self->offsets[mid] + self->bounds[mid].size.height < y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+// index of the first page whose top edge is below y
+static guint phi_document_view_first_page_starting_after(PhiDocumentView* self, gdouble y) {
+	guint lo = 0, hi = self->n_pages;
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (self->offsets[mid] <= y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Pages intersecting the viewport, extended by margin viewport heights in both directions
+static void phi_document_view_get_page_range(PhiDocumentView* self, gdouble margin, guint* first, guint* last) {
+	gdouble height = gtk_widget_get_height(GTK_WIDGET(self)) / self->zoom;
+	gdouble top = (self->vadjustment ? gtk_adjustment_get_value(self->vadjustment) : 0.) / self->zoom;
+	*first = phi_document_view_first_page_ending_after(self, top - margin * height);
+	*last = phi_document_view_first_page_starting_after(self, top + height + margin * height);
+	if (*last < *first)
+		*last = *first;
+}
+
+typedef struct {
+	PhiDocumentView* view; // strong
+	guint index;
+	GCancellable* cancellable;
+} PhiDocumentViewRequest;
+
+static void phi_document_view_page_rendered(GObject* source, GAsyncResult* res, gpointer user_data) {
+	PhiDocumentViewRequest* request = user_data;
+	PhiDocumentView* self = request->view;
+
+	GError* error = NULL;
+	GskRenderNode* node = phi_page_render_to_node_finish(PHI_PAGE(source), res, &error);
+	if (!node) {
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to render page %u: %s", request->index, error->message);
+		g_error_free(error);
+	} else if (request->index < self->n_pages && self->slots[request->index].cancellable == request->cancellable) {
+		PhiDocumentViewSlot* slot = &self->slots[request->index];
+		slot->node = g_steal_pointer(&node);
+		g_clear_object(&slot->cancellable);
+		gtk_widget_queue_draw(GTK_WIDGET(self));
+	}
+
+	if (node)
+		gsk_render_node_unref(node);
+	g_object_unref(request->cancellable);
+	g_object_unref(request->view);
+	g_free(request);
+}
+
+static void phi_document_view_request_page(PhiDocumentView* self, guint index) {
+	GError* error = NULL;
+	PhiPage* page = phi_document_get_page(self->document, index, &error);
+	if (!page) {
+		g_warning("Failed to load page %u: %s", index, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	PhiDocumentViewSlot* slot = &self->slots[index];
+	slot->cancellable = g_cancellable_new();
+
+	PhiDocumentViewRequest* request = g_new(PhiDocumentViewRequest, 1);
+	request->view = g_object_ref(self);
+	request->index = index;
+	request->cancellable = g_object_ref(slot->cancellable);
+	phi_page_render_to_node_async(page, slot->cancellable, phi_document_view_page_rendered, request);
+	g_object_unref(page);
+}
+
+static void phi_document_view_update_pages(PhiDocumentView* self) {
+	if (self->n_pages == 0)
+		return;
+
+	guint first, last;
+	phi_document_view_get_page_range(self, PHI_DOCUMENT_VIEW_PREFETCH, &first, &last);
+
+	for (guint i = self->active_first; i < self->active_last; i++)
+		if (i < first || i >= last)
+			phi_document_view_slot_release(&self->slots[i]);
+
+	for (guint i = first; i < last; i++)
+		if (!self->slots[i].node && !self->slots[i].cancellable)
+			phi_document_view_request_page(self, i);
+
+	self->active_first = first;
+	self->active_last = last;
+}
+
+static void phi_document_view_adjustment_value_changed(PhiDocumentView* self) {
+	phi_document_view_update_pages(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void phi_document_view_set_adjustment(PhiDocumentView* self, GtkAdjustment** slot, GtkAdjustment* adjustment) {
+	if (adjustment && *slot == adjustment)
+		return;
+
+	if (*slot) {
+		g_signal_handlers_disconnect_by_func(*slot, phi_document_view_adjustment_value_changed, self);
+		g_object_unref(*slot);
+	}
+	if (!adjustment)
+		adjustment = gtk_adjustment_new(0., 0., 0., 0., 0., 0.);
+	*slot = g_object_ref_sink(adjustment);
+	g_signal_connect_swapped(adjustment, "value-changed", G_CALLBACK(phi_document_view_adjustment_value_changed), self);
+
+	phi_document_view_configure_adjustments(self);
+}
+
+static void phi_document_view_items_changed(PhiDocumentView* self, guint, guint, guint) {
+	phi_document_view_build_layout(self);
+	phi_document_view_configure_adjustments(self);
+	phi_document_view_update_pages(self);
+	gtk_widget_queue_resize(GTK_WIDGET(self));
+}
+
+static void phi_document_view_page_geometry_changed(PhiDocumentView* self) {
+	phi_document_view_items_changed(self, 0, 0, 0);
+}
+
+static void phi_document_view_object_dispose(GObject* object) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(object);
+	phi_document_view_clear_layout(self);
+	if (self->document) {
+		g_clear_signal_handler(&self->items_changed_id, self->document);
+		g_clear_signal_handler(&self->page_geometry_changed_id, self->document);
+		g_clear_object(&self->document);
+	}
+	if (self->hadjustment) {
+		g_signal_handlers_disconnect_by_func(self->hadjustment, phi_document_view_adjustment_value_changed, self);
+		g_clear_object(&self->hadjustment);
+	}
+	if (self->vadjustment) {
+		g_signal_handlers_disconnect_by_func(self->vadjustment, phi_document_view_adjustment_value_changed, self);
+		g_clear_object(&self->vadjustment);
+	}
+	G_OBJECT_CLASS(phi_document_view_parent_class)->dispose(object);
+}
+
+static void phi_document_view_object_get_property(GObject* object, guint prop_id, GValue* val, GParamSpec* pspec) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(object);
+	switch (prop_id) {
+		case PROP_DOCUMENT:
+			g_value_set_object(val, phi_document_view_get_document(self));
+			break;
+		case PROP_ZOOM:
+			g_value_set_double(val, phi_document_view_get_zoom(self));
+			break;
+		case PROP_HADJUSTMENT:
+			g_value_set_object(val, self->hadjustment);
+			break;
+		case PROP_VADJUSTMENT:
+			g_value_set_object(val, self->vadjustment);
+			break;
+		case PROP_HSCROLL_POLICY:
+			g_value_set_enum(val, self->hscroll_policy);
+			break;
+		case PROP_VSCROLL_POLICY:
+			g_value_set_enum(val, self->vscroll_policy);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+static void phi_document_view_object_set_property(GObject* object, guint prop_id, const GValue* val, GParamSpec* pspec) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(object);
+	switch (prop_id) {
+		case PROP_DOCUMENT:
+			phi_document_view_set_document(self, g_value_get_object(val));
+			break;
+		case PROP_ZOOM:
+			phi_document_view_set_zoom(self, g_value_get_double(val));
+			break;
+		case PROP_HADJUSTMENT:
+			phi_document_view_set_adjustment(self, &self->hadjustment, g_value_get_object(val));
+			break;
+		case PROP_VADJUSTMENT:
+			phi_document_view_set_adjustment(self, &self->vadjustment, g_value_get_object(val));
+			break;
+		case PROP_HSCROLL_POLICY:
+			if (self->hscroll_policy != (GtkScrollablePolicy)g_value_get_enum(val)) {
+				self->hscroll_policy = g_value_get_enum(val);
+				gtk_widget_queue_resize(GTK_WIDGET(self));
+				g_object_notify_by_pspec(object, pspec);
+			}
+			break;
+		case PROP_VSCROLL_POLICY:
+			if (self->vscroll_policy != (GtkScrollablePolicy)g_value_get_enum(val)) {
+				self->vscroll_policy = g_value_get_enum(val);
+				gtk_widget_queue_resize(GTK_WIDGET(self));
+				g_object_notify_by_pspec(object, pspec);
+			}
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+	}
+}
+
+static void phi_document_view_widget_measure(GtkWidget* widget, GtkOrientation orientation, int, int* minimum, int* natural, int* minimum_baseline, int* natural_baseline) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(widget);
+	*minimum = 0;
+	if (orientation == GTK_ORIENTATION_HORIZONTAL)
+		*natural = (int)ceil(self->layout_width * self->zoom);
+	else
+		*natural = (int)ceil(self->layout_height * self->zoom);
+	*minimum_baseline = -1;
+	*natural_baseline = -1;
+}
+
+static void phi_document_view_widget_size_allocate(GtkWidget* widget, G_GNUC_UNUSED int width, G_GNUC_UNUSED int height, G_GNUC_UNUSED int baseline) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(widget);
+	phi_document_view_configure_adjustments(self);
+	phi_document_view_update_pages(self);
+}
+
+static void phi_document_view_widget_snapshot(GtkWidget* widget, GtkSnapshot* snapshot) {
+	PhiDocumentView* self = PHI_DOCUMENT_VIEW(widget);
+	if (self->n_pages == 0)
+		return;
+
+	guint first, last;
+	phi_document_view_get_page_range(self, 0., &first, &last);
+
+	gdouble width = gtk_widget_get_width(widget);
+	gdouble content_width = self->layout_width * self->zoom;
+	gdouble origin_x = content_width < width || !self->hadjustment ? (width - content_width) / 2. : -gtk_adjustment_get_value(self->hadjustment);
+	gdouble origin_y = self->vadjustment ? -gtk_adjustment_get_value(self->vadjustment) : 0.;
+
+	for (guint i = first; i < last; i++) {
+		const graphene_rect_t* bounds = &self->bounds[i];
+		graphene_rect_t rect;
+		graphene_rect_init(&rect,
+			origin_x + (self->layout_width - bounds->size.width) / 2. * self->zoom,
+			origin_y + self->offsets[i] * self->zoom,
+			bounds->size.width * self->zoom,
+			bounds->size.height * self->zoom
+		);
+		gtk_snapshot_append_color(snapshot, &(GdkRGBA){ .red = 1., .green = 1., .blue = 1., .alpha = 1. }, &rect);
+
+		GskRenderNode* node = self->slots[i].node;
+		if (!node)
+			continue;
+
+		gtk_snapshot_push_clip(snapshot, &rect);
+		gtk_snapshot_save(snapshot);
+		gtk_snapshot_translate(snapshot, &rect.origin);
+		gtk_snapshot_scale(snapshot, self->zoom, self->zoom);
+		gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(-bounds->origin.x, -bounds->origin.y));
+		gtk_snapshot_append_node(snapshot, node);
+		gtk_snapshot_restore(snapshot);
+		gtk_snapshot_pop(snapshot);
+	}
+}
+
+static gboolean phi_document_view_scroll(GtkEventControllerScroll* controller, gdouble, gdouble dy, PhiDocumentView* self) {
+	GdkModifierType state = gtk_event_controller_get_current_event_state(GTK_EVENT_CONTROLLER(controller));
+	if (!(state & GDK_CONTROL_MASK))
+		return FALSE;
+
+	phi_document_view_set_zoom(self, self->zoom * pow(1.1, -dy));
+	return TRUE;
+}
+
+static void phi_document_view_class_init(PhiDocumentViewClass* klass) {
+	GObjectClass* object_class = G_OBJECT_CLASS(klass);
+	GtkWidgetClass* widget_class = GTK_WIDGET_CLASS(klass);
+
+	object_class->dispose = phi_document_view_object_dispose;
+	object_class->get_property = phi_document_view_object_get_property;
+	object_class->set_property = phi_document_view_object_set_property;
+	widget_class->measure = phi_document_view_widget_measure;
+	widget_class->size_allocate = phi_document_view_widget_size_allocate;
+	widget_class->snapshot = phi_document_view_widget_snapshot;
+
+	obj_properties[PROP_DOCUMENT] = g_param_spec_object("document", NULL, NULL, PHI_TYPE_DOCUMENT, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+	obj_properties[PROP_ZOOM] = g_param_spec_double("zoom", NULL, NULL, 0.01, 100., 1., G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+	g_object_class_install_properties(object_class, N_PROPERTIES, obj_properties);
+
+	g_object_class_override_property(object_class, PROP_HADJUSTMENT, "hadjustment");
+	g_object_class_override_property(object_class, PROP_VADJUSTMENT, "vadjustment");
+	g_object_class_override_property(object_class, PROP_HSCROLL_POLICY, "hscroll-policy");
+	g_object_class_override_property(object_class, PROP_VSCROLL_POLICY, "vscroll-policy");
+}
+
+static void phi_document_view_init(PhiDocumentView* self) {
+	self->document = NULL;
+	self->items_changed_id = 0;
+	self->page_geometry_changed_id = 0;
+	self->zoom = 1.;
+	self->hscroll_policy = GTK_SCROLL_MINIMUM;
+	self->vscroll_policy = GTK_SCROLL_MINIMUM;
+
+	self->n_pages = 0;
+	self->bounds = NULL;
+	self->offsets = NULL;
+	self->slots = NULL;
+	self->active_first = 0;
+	self->active_last = 0;
+
+	gtk_widget_set_overflow(GTK_WIDGET(self), GTK_OVERFLOW_HIDDEN);
+
+	GtkEventController* scroll = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_VERTICAL);
+	g_signal_connect(scroll, "scroll", G_CALLBACK(phi_document_view_scroll), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), scroll);
+}
+
+GtkWidget* phi_document_view_new(PhiDocument* document) {
+	return g_object_new(PHI_TYPE_DOCUMENT_VIEW, "document", document, NULL);
+}
+
+PhiDocument* phi_document_view_get_document(PhiDocumentView* self) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT_VIEW(self), NULL);
+	return self->document;
+}
+
+void phi_document_view_set_document(PhiDocumentView* self, PhiDocument* document) {
+	g_return_if_fail(PHI_IS_DOCUMENT_VIEW(self));
+	g_return_if_fail(document == NULL || PHI_IS_DOCUMENT(document));
+	if (self->document == document)
+		return;
+
+	if (self->document) {
+		g_clear_signal_handler(&self->items_changed_id, self->document);
+		g_clear_signal_handler(&self->page_geometry_changed_id, self->document);
+		g_clear_object(&self->document);
+	}
+	if (document) {
+		self->document = g_object_ref(document);
+		self->items_changed_id = g_signal_connect_swapped(document, "items-changed", G_CALLBACK(phi_document_view_items_changed), self);
+		self->page_geometry_changed_id = g_signal_connect_swapped(document, "page-geometry-changed", G_CALLBACK(phi_document_view_page_geometry_changed), self);
+	}
+
+	phi_document_view_items_changed(self, 0, 0, 0);
+	g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_DOCUMENT]);
+}
+
+gdouble phi_document_view_get_zoom(PhiDocumentView* self) {
+	g_return_val_if_fail(PHI_IS_DOCUMENT_VIEW(self), 1.);
+	return self->zoom;
+}
+
+void phi_document_view_set_zoom(PhiDocumentView* self, gdouble zoom) {
+	g_return_if_fail(PHI_IS_DOCUMENT_VIEW(self));
+	zoom = CLAMP(zoom, 0.01, 100.);
+	if (self->zoom == zoom)
+		return;
+
+	// keep whatever is in the center of the viewport in place
+	gdouble width = gtk_widget_get_width(GTK_WIDGET(self));
+	gdouble height = gtk_widget_get_height(GTK_WIDGET(self));
+	gdouble center_x = self->hadjustment ? (gtk_adjustment_get_value(self->hadjustment) + width / 2.) / self->zoom : 0.;
+	gdouble center_y = self->vadjustment ? (gtk_adjustment_get_value(self->vadjustment) + height / 2.) / self->zoom : 0.;
+
+	self->zoom = zoom;
+	phi_document_view_configure_adjustments(self);
+	if (self->hadjustment)
+		gtk_adjustment_set_value(self->hadjustment, center_x * zoom - width / 2.);
+	if (self->vadjustment)
+		gtk_adjustment_set_value(self->vadjustment, center_y * zoom - height / 2.);
+
+	phi_document_view_update_pages(self);
+	g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_ZOOM]);
+	gtk_widget_queue_resize(GTK_WIDGET(self));
+}
@@ -0,0 +1,42 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PHIDOCUMENTVIEW_H__
+#define __PHIDOCUMENTVIEW_H__
+
+#include <gtk/gtk.h>
+
+#include <phi/phidocument.h>
+
+G_BEGIN_DECLS
+
+#define PHI_TYPE_DOCUMENT_VIEW (phi_document_view_get_type())
+G_DECLARE_FINAL_TYPE (PhiDocumentView, phi_document_view, PHI, DOCUMENT_VIEW, GtkWidget)
+
+GtkWidget* phi_document_view_new(PhiDocument* document);
+
+PhiDocument* phi_document_view_get_document(PhiDocumentView* self);
+void phi_document_view_set_document(PhiDocumentView* self, PhiDocument* document);
+
+gdouble phi_document_view_get_zoom(PhiDocumentView* self);
+void phi_document_view_set_zoom(PhiDocumentView* self, gdouble zoom);
+
+G_END_DECLS
+
+#endif // __PHIDOCUMENTVIEW_H__
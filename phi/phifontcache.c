@@ -0,0 +1,274 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/phifontcacheprivate.h"
+
+#include <glib/gstdio.h>
+#include <fontconfig/fontconfig.h>
+#include <pango/pangocairo.h>
+#include <pango/pangofc-fontmap.h>
+
+// a temporary copy of an embedded font program, removed once nothing uses it anymore
+typedef struct {
+	gchar* path;
+} PhiFontFile;
+
+static void phi_font_file_clear(PhiFontFile* self) {
+	g_unlink(self->path);
+	g_free(self->path);
+}
+static void phi_font_file_release(PhiFontFile* self) {
+	g_atomic_rc_box_release_full(self, (GDestroyNotify)phi_font_file_clear);
+}
+static void phi_font_file_font_finalized(gpointer self, GObject*) {
+	phi_font_file_release(self);
+}
+
+static void phi_font_cache_lock_free(GMutex* lock) {
+	g_mutex_clear(lock);
+	g_free(lock);
+}
+
+typedef struct {
+	fz_font* font;
+	gboolean loaded;
+	// NULL if the font can't be used natively
+	PangoFont* pango;
+	PangoFontMap* map;
+
+	// GHashTable<glyph id, GskPath>, outlines in glyph space
+	GHashTable* outlines;
+	// GHashTable<glyph id, GskRenderNode>, recorded Type 3 glyphs in glyph space
+	GHashTable* glyphs;
+
+	// in PhiFontCache.lru
+	GList link;
+} PhiFontCacheEntry;
+
+struct _PhiFontCache {
+	GMutex lock;
+	// GHashTable<fz_font*, PhiFontCacheEntry>, keeps the fz_font alive so its address stays unique
+	GHashTable* fonts;
+	// GQueue<PhiFontCacheEntry>, most recently used first
+	GQueue lru;
+};
+
+PhiFontCache* phi_font_cache_new(void) {
+	PhiFontCache* self = g_new0(PhiFontCache, 1);
+	g_mutex_init(&self->lock);
+	self->fonts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_queue_init(&self->lru);
+	return self;
+}
+
+static void phi_font_cache_entry_free(PhiFontCacheEntry* entry, fz_context* ctx) {
+	fz_drop_font(ctx, entry->font);
+	g_clear_object(&entry->pango);
+	g_clear_object(&entry->map);
+	g_hash_table_unref(entry->outlines);
+	g_hash_table_unref(entry->glyphs);
+	g_free(entry);
+}
+
+void phi_font_cache_free(PhiFontCache* self, fz_context* ctx) {
+	GHashTableIter iter;
+	PhiFontCacheEntry* entry;
+	g_hash_table_iter_init(&iter, self->fonts);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&entry))
+		phi_font_cache_entry_free(entry, ctx);
+	g_hash_table_unref(self->fonts);
+	g_mutex_clear(&self->lock);
+	g_free(self);
+}
+
+/* FreeType, cairo and HarfBuzz all want to open the face by path, so the
+ * embedded font program is written to a temporary file which is then
+ * added to a private FcConfig. That config contains only this face, so
+ * every description matches it.
+ */
+static void phi_font_cache_load(fz_context* ctx, PhiFontCacheEntry* entry) {
+	fz_font* font = entry->font;
+	// Type 3 glyphs are content streams, synthesized styles are only applied by MuPDFs own rasterizer
+	if (!font->buffer || font->t3procs || font->flags.fake_bold || font->flags.fake_italic)
+		return;
+
+	unsigned char* data;
+	size_t len = fz_buffer_storage(ctx, font->buffer, &data);
+
+	GError* error = NULL;
+	PhiFontFile* file = g_atomic_rc_box_new0(PhiFontFile);
+	gint fd = g_file_open_tmp("phi-font-XXXXXX", &file->path, &error);
+	if (fd < 0) {
+		g_warning("Failed to create file for font %s: %s", fz_font_name(ctx, font), error->message);
+		g_error_free(error);
+		g_atomic_rc_box_release(file);
+		return;
+	}
+	g_close(fd, NULL);
+	if (!g_file_set_contents(file->path, (const gchar*)data, len, &error)) {
+		g_warning("Failed to write font %s: %s", fz_font_name(ctx, font), error->message);
+		g_error_free(error);
+		phi_font_file_release(file);
+		return;
+	}
+
+	FcConfig* config = FcConfigCreate();
+	FcFontSet* set = NULL;
+	if (!FcConfigAppFontAddFile(config, (const FcChar8*)file->path) || !(set = FcConfigGetFonts(config, FcSetApplication)) || set->nfont < 1) {
+		g_debug("Fontconfig can't load font %s", fz_font_name(ctx, font));
+		FcConfigDestroy(config);
+		phi_font_file_release(file);
+		return;
+	}
+	FcChar8* family = NULL;
+	FcPatternGetString(set->fonts[0], FC_FAMILY, 0, &family);
+
+	// a font map of its own, so only this face is ever matched
+	entry->map = pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT);
+	pango_fc_font_map_set_config(PANGO_FC_FONT_MAP(entry->map), config);
+
+	PangoContext* context = pango_font_map_create_context(entry->map);
+	// glyphs are positioned by MuPDF, hinting would only shift them around
+	cairo_font_options_t* options = cairo_font_options_create();
+	cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+	cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+	pango_cairo_context_set_font_options(context, options);
+	cairo_font_options_destroy(options);
+	pango_context_set_round_glyph_positions(context, FALSE);
+
+	PangoFontDescription* desc = pango_font_description_new();
+	if (family)
+		pango_font_description_set_family(desc, (const gchar*)family);
+	pango_font_description_set_absolute_size(desc, PHI_FONT_CACHE_FONT_SIZE * PANGO_SCALE);
+	entry->pango = pango_font_map_load_font(entry->map, context, desc);
+	pango_font_description_free(desc);
+	g_object_unref(context);
+	FcConfigDestroy(config);
+
+	if (!entry->pango) {
+		g_debug("Pango can't load font %s", fz_font_name(ctx, font));
+		g_clear_object(&entry->map);
+		phi_font_file_release(file);
+		return;
+	}
+	// created while the font map is still around, the font may outlive it
+	pango_font_get_hb_font(entry->pango);
+	// cairo may reopen the face from disk at any time, so the file has to live as long as the font
+	g_object_weak_ref(G_OBJECT(entry->pango), phi_font_file_font_finalized, file);
+	GMutex* lock = g_new(GMutex, 1);
+	g_mutex_init(lock);
+	g_object_set_data_full(G_OBJECT(entry->pango), "phi-font-cache-lock", lock, (GDestroyNotify)phi_font_cache_lock_free);
+}
+
+// Must be called with the lock held
+static PhiFontCacheEntry* phi_font_cache_get_entry(PhiFontCache* self, fz_context* ctx, fz_font* font) {
+	PhiFontCacheEntry* entry = g_hash_table_lookup(self->fonts, font);
+	if (entry) {
+		g_queue_unlink(&self->lru, &entry->link);
+		g_queue_push_head_link(&self->lru, &entry->link);
+		return entry;
+	}
+
+	// the least recently used fonts are dropped, along with their glyphs
+	while (self->lru.length >= PHI_FONT_CACHE_MAX_FONTS) {
+		PhiFontCacheEntry* oldest = g_queue_peek_tail(&self->lru);
+		g_queue_unlink(&self->lru, &oldest->link);
+		g_hash_table_remove(self->fonts, oldest->font);
+		phi_font_cache_entry_free(oldest, ctx);
+	}
+
+	entry = g_new0(PhiFontCacheEntry, 1);
+	entry->font = fz_keep_font(ctx, font);
+	entry->outlines = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)gsk_path_unref);
+	entry->glyphs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)gsk_render_node_unref);
+	entry->link.data = entry;
+	g_hash_table_insert(self->fonts, font, entry);
+	g_queue_push_head_link(&self->lru, &entry->link);
+	return entry;
+}
+
+PangoFont* phi_font_cache_lookup(PhiFontCache* self, fz_context* ctx, fz_font* font) {
+	g_mutex_lock(&self->lock);
+	PhiFontCacheEntry* entry = phi_font_cache_get_entry(self, ctx, font);
+	if (!entry->loaded) {
+		phi_font_cache_load(ctx, entry);
+		entry->loaded = TRUE;
+	}
+	PangoFont* ret = entry->pango ? g_object_ref(entry->pango) : NULL;
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+void phi_font_cache_lock_font(PangoFont* font) {
+	g_mutex_lock(g_object_get_data(G_OBJECT(font), "phi-font-cache-lock"));
+}
+
+void phi_font_cache_unlock_font(PangoFont* font) {
+	g_mutex_unlock(g_object_get_data(G_OBJECT(font), "phi-font-cache-lock"));
+}
+
+GskPath* phi_font_cache_lookup_outline(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid) {
+	g_mutex_lock(&self->lock);
+	GskPath* ret = g_hash_table_lookup(phi_font_cache_get_entry(self, ctx, font)->outlines, GINT_TO_POINTER(gid));
+	if (ret)
+		gsk_path_ref(ret);
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+void phi_font_cache_insert_outline(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid, GskPath* path) {
+	g_mutex_lock(&self->lock);
+	GHashTable* outlines = phi_font_cache_get_entry(self, ctx, font)->outlines;
+	// another thread may have converted it in the meantime, keep the first one
+	if (g_hash_table_contains(outlines, GINT_TO_POINTER(gid)))
+		gsk_path_unref(path);
+	else
+		g_hash_table_insert(outlines, GINT_TO_POINTER(gid), path);
+	g_mutex_unlock(&self->lock);
+}
+
+GskRenderNode* phi_font_cache_lookup_glyph(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid) {
+	g_mutex_lock(&self->lock);
+	GskRenderNode* ret = g_hash_table_lookup(phi_font_cache_get_entry(self, ctx, font)->glyphs, GINT_TO_POINTER(gid));
+	if (ret)
+		gsk_render_node_ref(ret);
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+void phi_font_cache_insert_glyph(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid, GskRenderNode* node) {
+	g_mutex_lock(&self->lock);
+	GHashTable* glyphs = phi_font_cache_get_entry(self, ctx, font)->glyphs;
+	if (g_hash_table_contains(glyphs, GINT_TO_POINTER(gid)))
+		gsk_render_node_unref(node);
+	else
+		g_hash_table_insert(glyphs, GINT_TO_POINTER(gid), node);
+	g_mutex_unlock(&self->lock);
+}
+
+void phi_font_cache_clear_glyphs(PhiFontCache* self) {
+	g_mutex_lock(&self->lock);
+	GHashTableIter iter;
+	PhiFontCacheEntry* entry;
+	g_hash_table_iter_init(&iter, self->fonts);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&entry)) {
+		g_hash_table_remove_all(entry->outlines);
+		g_hash_table_remove_all(entry->glyphs);
+	}
+	g_mutex_unlock(&self->lock);
+}
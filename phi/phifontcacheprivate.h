@@ -0,0 +1,60 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PHIFONTCACHEPRIVATE_H__
+#define __PHIFONTCACHEPRIVATE_H__
+
+#include <gsk/gsk.h>
+#include <mupdf/fitz.h>
+
+G_BEGIN_DECLS
+
+// every PangoFont handed out is loaded at this absolute size in pixels
+#define PHI_FONT_CACHE_FONT_SIZE 64.
+// fonts beyond this are dropped least recently used first
+#define PHI_FONT_CACHE_MAX_FONTS 256
+
+typedef struct _PhiFontCache PhiFontCache;
+
+PhiFontCache* phi_font_cache_new(void);
+void phi_font_cache_free(PhiFontCache* self, fz_context* ctx);
+
+/* Returns a new reference to a PangoFont backed by the same face as font,
+ * or NULL if font can't be rendered natively (e.g. Type 3 fonts). The
+ * font is shared by all conversions, so GSK caches its glyphs only once.
+ * PangoFonts aren't thread-safe: anything measuring glyphs, like
+ * gsk_text_node_new(), has to hold the lock of the font.
+ */
+PangoFont* phi_font_cache_lookup(PhiFontCache* self, fz_context* ctx, fz_font* font);
+void phi_font_cache_lock_font(PangoFont* font);
+void phi_font_cache_unlock_font(PangoFont* font);
+
+/* Glyphs that have to be drawn as geometry are converted once per font
+ * and glyph id, in glyph space. Inserting takes ownership, if an entry
+ * already exists the existing one is kept.
+ */
+GskPath* phi_font_cache_lookup_outline(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid);
+void phi_font_cache_insert_outline(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid, GskPath* path);
+GskRenderNode* phi_font_cache_lookup_glyph(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid);
+void phi_font_cache_insert_glyph(PhiFontCache* self, fz_context* ctx, fz_font* font, gint gid, GskRenderNode* node);
+void phi_font_cache_clear_glyphs(PhiFontCache* self);
+
+G_END_DECLS
+
+#endif // __PHIFONTCACHEPRIVATE_H__
@@ -88,3 +88,88 @@ fz_stream* phi_gio_stream_wrap(fz_context* ctx, GInputStream* stream) {
 	ret->seek = phi_gio_stream_seek;
 	return ret;
 }
+
+typedef struct {
+	fz_stream* chain;
+	GCancellable* cancellable;
+	GFileProgressCallback callback;
+	gpointer data;
+	goffset total;
+	// progress is the furthest position read, seeking back and forth doesn't move it backwards
+	goffset reported;
+	// once loading is done reads pass through whole buffers of chain
+	gboolean finished;
+} PhiProgressStreamState;
+
+// small enough that progress of documents read from memory still advances gradually
+#define PHI_PROGRESS_STREAM_CHUNK (64 * 1024)
+
+static void phi_progress_stream_drop(fz_context* ctx, PhiProgressStreamState* state) {
+	fz_drop_stream(ctx, state->chain);
+	g_clear_object(&state->cancellable);
+	g_free(state);
+}
+
+static int phi_progress_stream_next(fz_context* ctx, fz_stream* stream, size_t max) {
+	PhiProgressStreamState* state = (PhiProgressStreamState*)stream->state;
+	if (g_cancellable_is_cancelled(state->cancellable))
+		fz_throw(ctx, FZ_ERROR_ABORT, "Loading cancelled");
+
+	size_t len = fz_available(ctx, state->chain, max);
+	if (!state->finished)
+		len = MIN(len, PHI_PROGRESS_STREAM_CHUNK);
+	if (len == 0)
+		return -1;
+	stream->rp = state->chain->rp;
+	stream->wp = state->chain->rp + len;
+	state->chain->rp += len;
+	stream->pos += len;
+
+	if (state->callback && stream->pos > state->reported && (stream->pos - state->reported >= state->total / 100 || stream->pos >= state->total)) {
+		state->reported = stream->pos;
+		state->callback(state->reported, state->total, state->data);
+	}
+	return *stream->rp++;
+}
+
+static void phi_progress_stream_seek(fz_context* ctx, fz_stream* stream, int64_t offset, int whence) {
+	PhiProgressStreamState* state = (PhiProgressStreamState*)stream->state;
+	fz_seek(ctx, state->chain, offset, whence);
+	stream->pos = fz_tell(ctx, state->chain);
+	stream->rp = NULL;
+	stream->wp = NULL;
+}
+
+fz_stream* phi_gio_stream_wrap_progress(fz_context* ctx, fz_stream* chain, GCancellable* cancellable, GFileProgressCallback callback, gpointer data) {
+	fz_seek(ctx, chain, 0, SEEK_END);
+	goffset total = fz_tell(ctx, chain);
+	fz_seek(ctx, chain, 0, SEEK_SET);
+
+	PhiProgressStreamState* state = g_new0(PhiProgressStreamState, 1);
+	state->chain = fz_keep_stream(ctx, chain);
+	state->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+	state->callback = callback;
+	state->data = data;
+	state->total = total;
+
+	fz_stream* ret = NULL;
+	fz_try(ctx) {
+		ret = fz_new_stream(ctx, state, phi_progress_stream_next, (fz_stream_drop_fn*)phi_progress_stream_drop);
+	} fz_catch(ctx) {
+		phi_progress_stream_drop(ctx, state);
+		fz_rethrow(ctx);
+	}
+	ret->seek = phi_progress_stream_seek;
+	if (callback)
+		callback(0, total, data);
+	return ret;
+}
+
+void phi_gio_stream_finish_progress(fz_stream* stream) {
+	g_return_if_fail(stream->next == phi_progress_stream_next);
+	PhiProgressStreamState* state = (PhiProgressStreamState*)stream->state;
+	state->callback = NULL;
+	state->data = NULL;
+	g_clear_object(&state->cancellable);
+	state->finished = TRUE;
+}
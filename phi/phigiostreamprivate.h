@@ -25,6 +25,13 @@
 G_BEGIN_DECLS
 
 fz_stream* phi_gio_stream_wrap(fz_context* ctx, GInputStream* stream);
+/* Reads through to chain and reports how many of its bytes have been
+ * read so far. Throws FZ_ERROR_ABORT once cancellable is cancelled, so
+ * opening and repairing a document can be interrupted.
+ */
+fz_stream* phi_gio_stream_wrap_progress(fz_context* ctx, fz_stream* chain, GCancellable* cancellable, GFileProgressCallback callback, gpointer data);
+// forgets callback and cancellable, later reads of the document pass straight through to chain
+void phi_gio_stream_finish_progress(fz_stream* stream);
 
 G_END_DECLS
 
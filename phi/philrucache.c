@@ -0,0 +1,206 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/philrucacheprivate.h"
+
+typedef struct {
+	gpointer key;
+	gpointer value;
+	gsize cost;
+} PhiLruCacheEntry;
+
+struct _PhiLruCache {
+	GMutex lock;
+
+	// GHashTable<key, GList<PhiLruCacheEntry>>, the links point into entries
+	GHashTable* table;
+	// GQueue<PhiLruCacheEntry>, most recently used first
+	GQueue entries;
+
+	GDestroyNotify key_destroy_func;
+	GBoxedCopyFunc value_ref_func;
+	GDestroyNotify value_unref_func;
+
+	PhiLruCacheEvictFunc evict_func;
+	gpointer evict_data;
+
+	gsize budget;
+	gsize size;
+};
+
+static void phi_lru_cache_entry_free(PhiLruCache* self, PhiLruCacheEntry* entry) {
+	if (self->key_destroy_func)
+		self->key_destroy_func(entry->key);
+	self->value_unref_func(entry->value);
+	g_free(entry);
+}
+
+PhiLruCache* phi_lru_cache_new(GHashFunc hash_func, GEqualFunc key_equal_func, GDestroyNotify key_destroy_func, GBoxedCopyFunc value_ref_func, GDestroyNotify value_unref_func, gsize budget) {
+	PhiLruCache* self = g_new0(PhiLruCache, 1);
+	g_mutex_init(&self->lock);
+	self->table = g_hash_table_new(hash_func, key_equal_func);
+	g_queue_init(&self->entries);
+	self->key_destroy_func = key_destroy_func;
+	self->value_ref_func = value_ref_func;
+	self->value_unref_func = value_unref_func;
+	self->budget = budget;
+	self->size = 0;
+	return self;
+}
+
+void phi_lru_cache_free(PhiLruCache* self) {
+	g_hash_table_unref(self->table);
+	PhiLruCacheEntry* entry;
+	while ((entry = g_queue_pop_head(&self->entries)))
+		phi_lru_cache_entry_free(self, entry);
+	g_mutex_clear(&self->lock);
+	g_free(self);
+}
+
+void phi_lru_cache_set_evict_func(PhiLruCache* self, PhiLruCacheEvictFunc func, gpointer user_data) {
+	g_mutex_lock(&self->lock);
+	self->evict_func = func;
+	self->evict_data = user_data;
+	g_mutex_unlock(&self->lock);
+}
+
+// Must be called with the lock held, returns the unlinked entries
+static GList* phi_lru_cache_evict_locked(PhiLruCache* self, gsize target) {
+	GList* evicted = NULL;
+	while (self->size > target && self->entries.tail) {
+		PhiLruCacheEntry* entry = g_queue_pop_tail(&self->entries);
+		g_hash_table_remove(self->table, entry->key);
+		self->size -= entry->cost;
+		evicted = g_list_prepend(evicted, entry);
+	}
+	return evicted;
+}
+
+// Must be called without the lock held
+static void phi_lru_cache_finish_evicted(PhiLruCache* self, GList* evicted, PhiLruCacheEvictFunc func, gpointer data) {
+	for (GList* l = evicted; l; l = l->next) {
+		PhiLruCacheEntry* entry = l->data;
+		if (func)
+			func(entry->key, entry->value, data);
+		phi_lru_cache_entry_free(self, entry);
+	}
+	g_list_free(evicted);
+}
+
+static void phi_lru_cache_shrink_to(PhiLruCache* self, gsize target) {
+	g_mutex_lock(&self->lock);
+	GList* evicted = phi_lru_cache_evict_locked(self, target);
+	PhiLruCacheEvictFunc func = self->evict_func;
+	gpointer data = self->evict_data;
+	g_mutex_unlock(&self->lock);
+	phi_lru_cache_finish_evicted(self, evicted, func, data);
+}
+
+gsize phi_lru_cache_get_budget(PhiLruCache* self) {
+	g_mutex_lock(&self->lock);
+	gsize ret = self->budget;
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+void phi_lru_cache_set_budget(PhiLruCache* self, gsize budget) {
+	g_mutex_lock(&self->lock);
+	self->budget = budget;
+	g_mutex_unlock(&self->lock);
+	phi_lru_cache_shrink_to(self, budget);
+}
+
+gsize phi_lru_cache_get_size(PhiLruCache* self) {
+	g_mutex_lock(&self->lock);
+	gsize ret = self->size;
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+gpointer phi_lru_cache_lookup(PhiLruCache* self, gconstpointer key) {
+	gpointer ret = NULL;
+	g_mutex_lock(&self->lock);
+	GList* link = g_hash_table_lookup(self->table, key);
+	if (link) {
+		g_queue_unlink(&self->entries, link);
+		g_queue_push_head_link(&self->entries, link);
+		ret = self->value_ref_func(((PhiLruCacheEntry*)link->data)->value);
+	}
+	g_mutex_unlock(&self->lock);
+	return ret;
+}
+
+void phi_lru_cache_insert(PhiLruCache* self, gpointer key, gpointer value, gsize cost) {
+	PhiLruCacheEntry* entry = g_new(PhiLruCacheEntry, 1);
+	entry->key = key;
+	entry->value = value;
+	entry->cost = cost;
+
+	g_mutex_lock(&self->lock);
+	// entries larger than the whole budget would just flush everything else
+	if (cost > self->budget) {
+		g_mutex_unlock(&self->lock);
+		phi_lru_cache_entry_free(self, entry);
+		return;
+	}
+
+	PhiLruCacheEntry* replaced = NULL;
+	GList* link = g_hash_table_lookup(self->table, key);
+	if (link) {
+		replaced = link->data;
+		g_queue_delete_link(&self->entries, link);
+		g_hash_table_remove(self->table, replaced->key);
+		self->size -= replaced->cost;
+	}
+
+	g_queue_push_head(&self->entries, entry);
+	g_hash_table_insert(self->table, entry->key, self->entries.head);
+	self->size += cost;
+
+	GList* evicted = phi_lru_cache_evict_locked(self, self->budget);
+	PhiLruCacheEvictFunc func = self->evict_func;
+	gpointer data = self->evict_data;
+	g_mutex_unlock(&self->lock);
+
+	if (replaced)
+		phi_lru_cache_entry_free(self, replaced);
+	phi_lru_cache_finish_evicted(self, evicted, func, data);
+}
+
+void phi_lru_cache_remove(PhiLruCache* self, gconstpointer key) {
+	g_mutex_lock(&self->lock);
+	GList* link = g_hash_table_lookup(self->table, key);
+	PhiLruCacheEntry* entry = NULL;
+	if (link) {
+		entry = link->data;
+		g_queue_delete_link(&self->entries, link);
+		g_hash_table_remove(self->table, entry->key);
+		self->size -= entry->cost;
+	}
+	g_mutex_unlock(&self->lock);
+	if (entry)
+		phi_lru_cache_entry_free(self, entry);
+}
+
+void phi_lru_cache_shrink(PhiLruCache* self, gsize target) {
+	phi_lru_cache_shrink_to(self, target);
+}
+
+void phi_lru_cache_remove_all(PhiLruCache* self) {
+	phi_lru_cache_shrink_to(self, 0);
+}
@@ -0,0 +1,51 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __PHILRUCACHEPRIVATE_H__
+#define __PHILRUCACHEPRIVATE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PhiLruCache PhiLruCache;
+
+/* Called for every entry that got pushed out of the cache, after the
+ * cache lock has been released.
+ */
+typedef void (*PhiLruCacheEvictFunc)(gconstpointer key, gpointer value, gpointer user_data);
+
+PhiLruCache* phi_lru_cache_new(GHashFunc hash_func, GEqualFunc key_equal_func, GDestroyNotify key_destroy_func, GBoxedCopyFunc value_ref_func, GDestroyNotify value_unref_func, gsize budget);
+void phi_lru_cache_free(PhiLruCache* self);
+
+void phi_lru_cache_set_evict_func(PhiLruCache* self, PhiLruCacheEvictFunc func, gpointer user_data);
+
+gsize phi_lru_cache_get_budget(PhiLruCache* self);
+void phi_lru_cache_set_budget(PhiLruCache* self, gsize budget);
+gsize phi_lru_cache_get_size(PhiLruCache* self);
+
+gpointer phi_lru_cache_lookup(PhiLruCache* self, gconstpointer key);
+void phi_lru_cache_insert(PhiLruCache* self, gpointer key, gpointer value, gsize cost);
+void phi_lru_cache_remove(PhiLruCache* self, gconstpointer key);
+void phi_lru_cache_shrink(PhiLruCache* self, gsize target);
+void phi_lru_cache_remove_all(PhiLruCache* self);
+
+G_END_DECLS
+
+#endif // __PHILRUCACHEPRIVATE_H__
@@ -20,9 +20,15 @@
 
 #include <gtk/gtk.h>
 
+#include "phi/phicontextprivate.h"
+#include "phi/phinodeoptimizerprivate.h"
+#include "phi/phipixelconvertprivate.h"
+
 typedef enum {
 	PHI_RENDER_STATE_NONE,
 	PHI_RENDER_STATE_CLIP_PATH_FILL,
+	PHI_RENDER_STATE_CLIP_PATH_STROKE,
+	PHI_RENDER_STATE_CLIP_RECT,
 	PHI_RENDER_STATE_MASK,
 	PHI_RENDER_STATE_IN_MASK,
 } PhiRenderContextState;
@@ -39,6 +45,16 @@ typedef struct {
 			fz_matrix ctm;
 			fz_rect scissor;
 		} clip_path_fill;
+		struct {
+			GskPath* path;
+			GskStroke* stroke;
+			fz_matrix ctm;
+			fz_rect scissor;
+		} clip_path_stroke;
+		struct {
+			GskRoundedRect rect;
+			gboolean rounded;
+		} clip_rect;
 		struct {
 			GskRenderNode* mask;
 			GskMaskMode mode;
@@ -64,6 +80,12 @@ static void phi_render_context_clear(PhiRenderContext* self) {
 		case PHI_RENDER_STATE_CLIP_PATH_FILL:
 			gsk_path_unref (self->clip_path_fill.path);
 			break;
+		case PHI_RENDER_STATE_CLIP_PATH_STROKE:
+			gsk_path_unref(self->clip_path_stroke.path);
+			gsk_stroke_free(self->clip_path_stroke.stroke);
+			break;
+		case PHI_RENDER_STATE_CLIP_RECT:
+			break;
 		case PHI_RENDER_STATE_MASK:
 			gsk_render_node_unref(self->mask.mask);
 			break;
@@ -73,15 +95,65 @@ static void phi_render_context_clear(PhiRenderContext* self) {
 }
 
 
+typedef enum {
+	PHI_BATCH_KIND_NONE,
+	PHI_BATCH_KIND_FILL,
+	PHI_BATCH_KIND_STROKE,
+} PhiBatchKind;
+
+/* Consecutive fills or strokes that only differ in their geometry are
+ * collected into a single path. This is only done where it can't change
+ * the result: overlapping fills could cancel each other out under the
+ * winding rule, and overlapping translucent strokes would only blend once.
+ */
+typedef struct {
+	PhiBatchKind kind;
+	GdkRGBA color;
+	fz_matrix ctm;
+	int even_odd;
+	GskStroke* stroke;
+
+	// the first path is kept as is until a second one arrives, so it stays shared
+	GskPath* path;
+	GskPathBuilder* builder;
+	// GArray<graphene_rect_t>, bounds of every batched path
+	GArray* bounds;
+	graphene_rect_t extents;
+} PhiBatch;
+
 typedef struct {
 	fz_device super;
 	// GArray<PhiRenderContext>
 	GArray *stack;
+	// pending draws of the topmost context
+	PhiBatch batch;
+	// unset caches are skipped, without fonts all text is drawn from glyph outlines
+	PhiNodeDeviceCaches caches;
+	// tiles of large images outside of this aren't decoded
+	fz_rect visible;
+	/* Index of the context recording the innermost Type 3 glyph, 0 if none.
+	 * Glyphs are recorded in glyph space and reused at every size, so
+	 * everything above it is decoded at full resolution and never culled.
+	 */
+	guint glyph_base;
+	// GHashTable<fz_font*, PangoFont>, fonts used so far, NULL if not usable natively
+	GHashTable* fonts;
 } PhiNodeDevice;
 
+static void phi_batch_reset(PhiBatch* self) {
+	self->kind = PHI_BATCH_KIND_NONE;
+	g_clear_pointer(&self->stroke, gsk_stroke_free);
+	g_clear_pointer(&self->path, gsk_path_unref);
+	g_clear_pointer(&self->builder, gsk_path_builder_unref);
+	g_array_set_size(self->bounds, 0);
+}
+
 static void phi_node_device_drop(fz_context*, fz_device* dev) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	phi_batch_reset(&self->batch);
+	g_array_unref(self->batch.bounds);
 	g_array_unref(self->stack);
+	g_hash_table_unref(self->fonts);
 }
 
 static GskTransform* phi_node_device_transform_from_matrix(const fz_matrix* ctm) {
@@ -159,17 +231,413 @@ static GskPath* phi_node_device_convert_path(fz_context* ctx, const fz_path* pat
 	return gsk_path_builder_free_to_path(builder);
 }
 
-static GskRenderNode* phi_node_device_make_color(fz_context* ctx, fz_colorspace* cs, const float* color, float alpha, const graphene_rect_t *bounds) {
+static gboolean phi_node_device_estimate_path_op(GskPathOperation, const graphene_point_t*, gsize n_pts, float, gpointer user_data) {
+	gsize* size = user_data;
+	*size += sizeof(GskPathOperation) + n_pts * sizeof(graphene_point_t);
+	return TRUE;
+}
+static gsize phi_node_device_estimate_path_size(GskPath* path) {
+	gsize size = 0;
+	gsk_path_foreach(path, GSK_PATH_FOREACH_ALLOW_QUAD | GSK_PATH_FOREACH_ALLOW_CUBIC | GSK_PATH_FOREACH_ALLOW_CONIC, phi_node_device_estimate_path_op, &size);
+	return size;
+}
+
+static void phi_node_device_path_key_push(GByteArray* key, guint8 op, const float* coords, guint n_coords) {
+	g_byte_array_append(key, &op, 1);
+	g_byte_array_append(key, (const guint8*)coords, n_coords * sizeof(float));
+}
+static void phi_node_device_path_key_moveto(fz_context*, void* arg, float x, float y) {
+	phi_node_device_path_key_push(arg, 'M', (float[]){ x, y }, 2);
+}
+static void phi_node_device_path_key_lineto(fz_context*, void* arg, float x, float y) {
+	phi_node_device_path_key_push(arg, 'L', (float[]){ x, y }, 2);
+}
+static void phi_node_device_path_key_curveto(fz_context*, void* arg, float x1, float y1, float x2, float y2, float x3, float y3) {
+	phi_node_device_path_key_push(arg, 'C', (float[]){ x1, y1, x2, y2, x3, y3 }, 6);
+}
+static void phi_node_device_path_key_closepath(fz_context*, void* arg) {
+	phi_node_device_path_key_push(arg, 'Z', NULL, 0);
+}
+static void phi_node_device_path_key_quadto(fz_context*, void* arg, float x1, float y1, float x2, float y2) {
+	phi_node_device_path_key_push(arg, 'Q', (float[]){ x1, y1, x2, y2 }, 4);
+}
+static void phi_node_device_path_key_rectto(fz_context*, void* arg, float x1, float y1, float x2, float y2) {
+	phi_node_device_path_key_push(arg, 'R', (float[]){ x1, y1, x2, y2 }, 4);
+}
+const fz_path_walker phi_node_device_path_key_walker = {
+	.moveto = phi_node_device_path_key_moveto,
+	.lineto = phi_node_device_path_key_lineto,
+	.curveto = phi_node_device_path_key_curveto,
+	.closepath = phi_node_device_path_key_closepath,
+	.quadto = phi_node_device_path_key_quadto,
+	.rectto = phi_node_device_path_key_rectto
+};
+
+#define PHI_SHAPE_MAX_SEGMENTS 9
+#define PHI_SHAPE_EPSILON 0.01f
+
+typedef struct {
+	// control points of lines are unused
+	graphene_point_t pts[4];
+	gboolean curve;
+} PhiShapeSegment;
+
+/* Collects the segments of a single closed subpath in device space, to
+ * figure out whether a clip is a (rounded) rectangle.
+ */
+typedef struct {
+	fz_matrix ctm;
+	PhiShapeSegment segments[PHI_SHAPE_MAX_SEGMENTS];
+	guint n_segments;
+	graphene_point_t start;
+	graphene_point_t current;
+	gboolean started;
+	gboolean closed;
+	gboolean invalid;
+} PhiShape;
+
+static graphene_point_t phi_shape_transform(PhiShape* self, float x, float y) {
+	fz_point p = fz_transform_point_xy(x, y, self->ctm);
+	return GRAPHENE_POINT_INIT(p.x, p.y);
+}
+static gboolean phi_shape_near(float a, float b) {
+	return fabsf(a - b) < PHI_SHAPE_EPSILON;
+}
+static gboolean phi_shape_point_near(const graphene_point_t* a, const graphene_point_t* b) {
+	return phi_shape_near(a->x, b->x) && phi_shape_near(a->y, b->y);
+}
+static gboolean phi_shape_axis_aligned(const graphene_point_t* a, const graphene_point_t* b) {
+	return phi_shape_near(a->x, b->x) || phi_shape_near(a->y, b->y);
+}
+static void phi_shape_add(PhiShape* self, gboolean curve, const graphene_point_t* pts) {
+	if (!self->started || self->closed || self->n_segments == PHI_SHAPE_MAX_SEGMENTS) {
+		self->invalid = TRUE;
+		return;
+	}
+	graphene_point_t end = pts[curve ? 2 : 0];
+	// degenerate lines are common at corners and don't change the shape
+	if (!curve && phi_shape_point_near(&self->current, &end))
+		return;
+
+	PhiShapeSegment* seg = &self->segments[self->n_segments++];
+	seg->curve = curve;
+	seg->pts[0] = self->current;
+	for (guint i = 0; i < (curve ? 3u : 1u); i++)
+		seg->pts[i + 1] = pts[i];
+	self->current = end;
+}
+static void phi_shape_close(PhiShape* self) {
+	if (!self->started || self->closed)
+		return;
+	if (!phi_shape_point_near(&self->current, &self->start))
+		phi_shape_add(self, FALSE, &self->start);
+	self->closed = TRUE;
+}
+
+static void phi_shape_moveto(fz_context*, void* arg, float x, float y) {
+	PhiShape* self = arg;
+	// only a single subpath can be a rectangle
+	if (self->started && self->n_segments > 0) {
+		self->invalid = TRUE;
+		return;
+	}
+	self->start = self->current = phi_shape_transform(self, x, y);
+	self->started = TRUE;
+	self->closed = FALSE;
+}
+static void phi_shape_lineto(fz_context*, void* arg, float x, float y) {
+	PhiShape* self = arg;
+	graphene_point_t p = phi_shape_transform(self, x, y);
+	phi_shape_add(self, FALSE, &p);
+}
+static void phi_shape_curveto(fz_context*, void* arg, float x1, float y1, float x2, float y2, float x3, float y3) {
+	PhiShape* self = arg;
+	graphene_point_t pts[3] = {
+		phi_shape_transform(self, x1, y1),
+		phi_shape_transform(self, x2, y2),
+		phi_shape_transform(self, x3, y3)
+	};
+	phi_shape_add(self, TRUE, pts);
+}
+static void phi_shape_closepath(fz_context*, void* arg) {
+	phi_shape_close(arg);
+}
+static void phi_shape_quadto(fz_context*, void* arg, float, float, float, float) {
+	PhiShape* self = arg;
+	self->invalid = TRUE;
+}
+static void phi_shape_rectto(fz_context* ctx, void* arg, float x1, float y1, float x2, float y2) {
+	PhiShape* self = arg;
+	if (self->started) {
+		self->invalid = TRUE;
+		return;
+	}
+	phi_shape_moveto(ctx, self, x1, y1);
+	phi_shape_lineto(ctx, self, x2, y1);
+	phi_shape_lineto(ctx, self, x2, y2);
+	phi_shape_lineto(ctx, self, x1, y2);
+	phi_shape_close(self);
+}
+const fz_path_walker phi_shape_walker = {
+	.moveto = phi_shape_moveto,
+	.lineto = phi_shape_lineto,
+	.curveto = phi_shape_curveto,
+	.closepath = phi_shape_closepath,
+	.quadto = phi_shape_quadto,
+	.rectto = phi_shape_rectto
+};
+
+static gboolean phi_shape_on_edge(const graphene_rect_t* bounds, const graphene_point_t* p) {
+	return phi_shape_near(p->x, bounds->origin.x) || phi_shape_near(p->x, bounds->origin.x + bounds->size.width) ||
+	       phi_shape_near(p->y, bounds->origin.y) || phi_shape_near(p->y, bounds->origin.y + bounds->size.height);
+}
+
+/* Checks whether path is an axis-aligned rectangle, or one with elliptic
+ * corners, after ctm has been applied. Rotations by multiples of 90° and
+ * mirroring are fine, as only the transformed points are looked at.
+ * Corners have to be approximated by a single cubic each, which is what
+ * every PDF producer does.
+ */
+static gboolean phi_node_device_path_rounded_rect(fz_context* ctx, const fz_path* path, fz_matrix ctm, GskRoundedRect* out, gboolean* rounded) {
+	PhiShape shape = { .ctm = ctm };
+	fz_walk_path(ctx, path, &phi_shape_walker, &shape);
+	// fills close implicitly
+	phi_shape_close(&shape);
+	if (shape.invalid || shape.n_segments < 4)
+		return FALSE;
+
+	graphene_point_t min = shape.start, max = shape.start;
+	guint n_curves = 0;
+	for (guint i = 0; i < shape.n_segments; i++) {
+		const PhiShapeSegment* seg = &shape.segments[i];
+		const graphene_point_t* end = &seg->pts[seg->curve ? 3 : 1];
+		if (seg->curve) {
+			// tangents at both ends have to be axis-aligned for an elliptic corner
+			if (!phi_shape_axis_aligned(&seg->pts[0], &seg->pts[1]) || !phi_shape_axis_aligned(&seg->pts[2], &seg->pts[3]))
+				return FALSE;
+			n_curves++;
+		} else if (!phi_shape_axis_aligned(&seg->pts[0], end)) {
+			return FALSE;
+		}
+		min.x = MIN(min.x, end->x); min.y = MIN(min.y, end->y);
+		max.x = MAX(max.x, end->x); max.y = MAX(max.y, end->y);
+	}
+
+	graphene_rect_t bounds = GRAPHENE_RECT_INIT(min.x, min.y, max.x - min.x, max.y - min.y);
+	if (n_curves == 0) {
+		// alternately horizontal and vertical edges, one on each side of the bounding box, can only be the box itself
+		if (shape.n_segments != 4)
+			return FALSE;
+		guint sides = 0;
+		gboolean was_horizontal = FALSE;
+		for (guint i = 0; i < 4; i++) {
+			const graphene_point_t* a = &shape.segments[i].pts[0];
+			const graphene_point_t* b = &shape.segments[i].pts[1];
+			gboolean horizontal = phi_shape_near(a->y, b->y) && !phi_shape_near(a->x, b->x);
+			gboolean vertical = phi_shape_near(a->x, b->x) && !phi_shape_near(a->y, b->y);
+			if (horizontal == vertical || (i > 0 && horizontal == was_horizontal))
+				return FALSE;
+			was_horizontal = horizontal;
+
+			guint side = 0;
+			if (horizontal)
+				side = phi_shape_near(a->y, min.y) ? 1 << 0 : phi_shape_near(a->y, max.y) ? 1 << 1 : 0;
+			else
+				side = phi_shape_near(a->x, min.x) ? 1 << 2 : phi_shape_near(a->x, max.x) ? 1 << 3 : 0;
+			if (!side || (sides & side))
+				return FALSE;
+			sides |= side;
+		}
+		gsk_rounded_rect_init_from_rect(out, &bounds, 0);
+		*rounded = FALSE;
+		return TRUE;
+	}
+	if (n_curves != 4)
+		return FALSE;
+
+	graphene_size_t corners[4];
+	gboolean seen[4] = { FALSE };
+	graphene_point_t center;
+	graphene_rect_get_center(&bounds, &center);
+	for (guint i = 0; i < shape.n_segments; i++) {
+		const PhiShapeSegment* seg = &shape.segments[i];
+		if (!phi_shape_on_edge(&bounds, &seg->pts[0]))
+			return FALSE;
+		if (!seg->curve)
+			continue;
+
+		const graphene_point_t* a = &seg->pts[0];
+		const graphene_point_t* b = &seg->pts[3];
+		// an elliptic corner starts on one edge and ends on the adjacent one
+		if (phi_shape_near(a->x, b->x) || phi_shape_near(a->y, b->y))
+			return FALSE;
+		gboolean left = (a->x + b->x) / 2 < center.x;
+		gboolean top = (a->y + b->y) / 2 < center.y;
+		GskCorner corner = top ? (left ? GSK_CORNER_TOP_LEFT : GSK_CORNER_TOP_RIGHT) : (left ? GSK_CORNER_BOTTOM_LEFT : GSK_CORNER_BOTTOM_RIGHT);
+		if (seen[corner])
+			return FALSE;
+		seen[corner] = TRUE;
+		graphene_size_init(&corners[corner], fabsf(b->x - a->x), fabsf(b->y - a->y));
+	}
+
+	gsk_rounded_rect_init(out, &bounds, &corners[GSK_CORNER_TOP_LEFT], &corners[GSK_CORNER_TOP_RIGHT], &corners[GSK_CORNER_BOTTOM_RIGHT], &corners[GSK_CORNER_BOTTOM_LEFT]);
+	gsk_rounded_rect_normalize(out);
+	*rounded = TRUE;
+	return TRUE;
+}
+
+/* Like phi_node_device_convert_path, but identical geometry (e.g. from a
+ * form XObject drawn on every page) results in the same GskPath. The
+ * cache is keyed by the serialized segments, which is a lot cheaper to
+ * produce than a GskPath.
+ */
+static GskPath* phi_node_device_lookup_path(fz_context* ctx, PhiNodeDevice* self, const fz_path* path) {
+	if (!self->caches.paths)
+		return phi_node_device_convert_path(ctx, path);
+
+	GByteArray* data = g_byte_array_new();
+	fz_walk_path(ctx, path, &phi_node_device_path_key_walker, data);
+	// for a handful of segments bookkeeping costs more than converting again
+	if (data->len < PHI_NODE_DEVICE_MIN_CACHED_PATH_SIZE) {
+		g_byte_array_unref(data);
+		return phi_node_device_convert_path(ctx, path);
+	}
+	GBytes* key = g_byte_array_free_to_bytes(data);
+
+	GskPath* ret = phi_lru_cache_lookup(self->caches.paths, key);
+	if (ret) {
+		g_bytes_unref(key);
+		return ret;
+	}
+
+	ret = phi_node_device_convert_path(ctx, path);
+	gsize cost = g_bytes_get_size(key) + phi_node_device_estimate_path_size(ret);
+	phi_lru_cache_insert(self->caches.paths, key, gsk_path_ref(ret), cost);
+	return ret;
+}
+
+static void phi_node_device_convert_color(fz_context* ctx, fz_colorspace* cs, const float* color, float alpha, GdkRGBA* rgba) {
 	switch (fz_colorspace_type(ctx, cs)) {
 		case FZ_COLORSPACE_RGB:
-			return gsk_color_node_new(&(GdkRGBA){ .red = color[0], .green = color[1], .blue = color[2], .alpha = alpha }, bounds);
+			*rgba = (GdkRGBA){ .red = color[0], .green = color[1], .blue = color[2], .alpha = alpha };
+			break;
 		case FZ_COLORSPACE_BGR:
-			return gsk_color_node_new(&(GdkRGBA){ .red = color[2], .green = color[1], .blue = color[0], .alpha = alpha }, bounds);
+			*rgba = (GdkRGBA){ .red = color[2], .green = color[1], .blue = color[0], .alpha = alpha };
+			break;
 		case FZ_COLORSPACE_GRAY:
-			return gsk_color_node_new(&(GdkRGBA){ .red = color[0], .green = color[0], .blue = color[0], .alpha = alpha }, bounds);
-	default:
-		return NULL;
-	}	
+			*rgba = (GdkRGBA){ .red = color[0], .green = color[0], .blue = color[0], .alpha = alpha };
+			break;
+		default: {
+			float rgb[3];
+			fz_convert_color(ctx, cs, color, fz_device_rgb(ctx), rgb, NULL, fz_default_color_params);
+			*rgba = (GdkRGBA){ .red = rgb[0], .green = rgb[1], .blue = rgb[2], .alpha = alpha };
+		} break;
+	}
+}
+
+static GskRenderNode* phi_node_device_make_color(fz_context* ctx, fz_colorspace* cs, const float* color, float alpha, const graphene_rect_t *bounds) {
+	GdkRGBA rgba;
+	phi_node_device_convert_color(ctx, cs, color, alpha, &rgba);
+	return gsk_color_node_new(&rgba, bounds);
+}
+
+// Collapses the children of a context into a single node
+static GskRenderNode* phi_render_context_collapse(PhiRenderContext* self) {
+	if (self->children->len == 1)
+		return gsk_render_node_ref(g_ptr_array_index(self->children, 0));
+	return gsk_container_node_new((GskRenderNode**)self->children->pdata, self->children->len);
+}
+
+static void phi_node_device_append_unbatched(PhiNodeDevice* self, GskRenderNode* node) {
+	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
+	g_ptr_array_add(current->children, node);
+}
+
+static GskRenderNode* phi_node_device_node_from_fillpath(GskRenderNode* child, GskPath* path, int even_odd, const fz_matrix* child_ctm, const fz_matrix* ctm);
+
+// Emits the pending batch, must happen before anything else is drawn or the stack changes
+static void phi_node_device_flush(PhiNodeDevice* self) {
+	PhiBatch* batch = &self->batch;
+	if (batch->kind == PHI_BATCH_KIND_NONE)
+		return;
+
+	GskPath* path = batch->builder ? gsk_path_builder_to_path(batch->builder) : gsk_path_ref(batch->path);
+	GskRenderNode* fill = gsk_color_node_new(&batch->color, &batch->extents);
+	GskRenderNode* node;
+	if (batch->kind == PHI_BATCH_KIND_FILL) {
+		node = phi_node_device_node_from_fillpath(fill, path, batch->even_odd, &fz_identity, &batch->ctm);
+	} else {
+		node = gsk_stroke_node_new(fill, path, batch->stroke);
+		gsk_render_node_unref(fill);
+		node = phi_node_device_transform_child(node, &batch->ctm);
+	}
+	gsk_path_unref(path);
+	phi_node_device_append_unbatched(self, node);
+	phi_batch_reset(batch);
+}
+
+static void phi_node_device_append(PhiNodeDevice* self, GskRenderNode* node) {
+	phi_node_device_flush(self);
+	phi_node_device_append_unbatched(self, node);
+}
+
+static void phi_node_device_push(PhiNodeDevice* self, PhiRenderContext* context) {
+	phi_node_device_flush(self);
+	g_array_append_val(self->stack, *context);
+}
+
+static gboolean phi_batch_accepts(PhiBatch* self, PhiBatchKind kind, const GdkRGBA* color, const fz_matrix* ctm, int even_odd, const GskStroke* stroke, const graphene_rect_t* bounds) {
+	if (self->kind != kind || self->bounds->len >= PHI_NODE_DEVICE_MAX_BATCH)
+		return FALSE;
+	if (!gdk_rgba_equal(&self->color, color) || memcmp(&self->ctm, ctm, sizeof(fz_matrix)) != 0)
+		return FALSE;
+
+	if (kind == PHI_BATCH_KIND_FILL) {
+		if (self->even_odd != even_odd)
+			return FALSE;
+	} else {
+		gsize n_dash;
+		// dash patterns would continue across the subpaths of separate strokes
+		gsk_stroke_get_dash(stroke, &n_dash);
+		if (n_dash > 0 || !gsk_stroke_equal(self->stroke, stroke))
+			return FALSE;
+		// overlapping opaque strokes look the same drawn once
+		if (color->alpha >= 1.f)
+			return TRUE;
+	}
+
+	if (!graphene_rect_intersection(&self->extents, bounds, NULL))
+		return TRUE;
+	for (guint i = 0; i < self->bounds->len; i++) {
+		if (graphene_rect_intersection(&g_array_index(self->bounds, graphene_rect_t, i), bounds, NULL))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void phi_node_device_batch(PhiNodeDevice* self, PhiBatchKind kind, const GdkRGBA* color, const fz_matrix* ctm, int even_odd, const GskStroke* stroke, GskPath* path, const graphene_rect_t* bounds) {
+	PhiBatch* batch = &self->batch;
+	if (!phi_batch_accepts(batch, kind, color, ctm, even_odd, stroke, bounds)) {
+		phi_node_device_flush(self);
+		batch->kind = kind;
+		batch->color = *color;
+		batch->ctm = *ctm;
+		batch->even_odd = even_odd;
+		batch->stroke = stroke ? gsk_stroke_copy(stroke) : NULL;
+		batch->path = gsk_path_ref(path);
+		batch->extents = *bounds;
+		g_array_append_val(batch->bounds, *bounds);
+		return;
+	}
+
+	if (!batch->builder) {
+		batch->builder = gsk_path_builder_new();
+		gsk_path_builder_add_path(batch->builder, batch->path);
+		g_clear_pointer(&batch->path, gsk_path_unref);
+	}
+	gsk_path_builder_add_path(batch->builder, path);
+	graphene_rect_union(&batch->extents, bounds, &batch->extents);
+	g_array_append_val(batch->bounds, *bounds);
 }
 
 static GskRenderNode* phi_node_device_node_from_fillpath(GskRenderNode* child, GskPath* path, int even_odd, const fz_matrix* child_ctm, const fz_matrix* ctm) {
@@ -182,26 +650,23 @@ static GskRenderNode* phi_node_device_node_from_fillpath(GskRenderNode* child, G
 	return phi_node_device_transform_child(node, ctm);
 }
 
-static void phi_node_device_fill_path(fz_context* ctx, fz_device* dev, const fz_path* path, int even_odd, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
-	PhiNodeDevice* self = (PhiNodeDevice*)dev;
-
-	GskPath* cpath = phi_node_device_convert_path(ctx, path);
-	
+static void phi_node_device_append_fill(PhiNodeDevice* self, fz_context* ctx, GskPath* cpath, int even_odd, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha) {
 	graphene_rect_t bounds;
 	if (!gsk_path_get_bounds(cpath, &bounds))
 		graphene_rect_init(&bounds, 0.f, 0.f, 0.f, 0.f);
-	GskRenderNode* fill = phi_node_device_make_color(ctx, cs, color, alpha, &bounds);
-	
-	GskRenderNode* node = phi_node_device_node_from_fillpath(fill, cpath, even_odd, &fz_identity, &ctm);
-	gsk_path_unref(cpath);
-
-	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
-	g_ptr_array_add(current->children, node);
+	GdkRGBA rgba;
+	phi_node_device_convert_color(ctx, cs, color, alpha, &rgba);
+	phi_node_device_batch(self, PHI_BATCH_KIND_FILL, &rgba, &ctm, even_odd, NULL, cpath, &bounds);
 }
 
-static void phi_node_device_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path, const fz_stroke_state* ss, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
+static void phi_node_device_fill_path(fz_context* ctx, fz_device* dev, const fz_path* path, int even_odd, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	GskPath* cpath = phi_node_device_lookup_path(ctx, self, path);
+	phi_node_device_append_fill(self, ctx, cpath, even_odd, ctm, cs, color, alpha);
+	gsk_path_unref(cpath);
+}
 
+static GskStroke* phi_node_device_convert_stroke(fz_context* ctx, const fz_stroke_state* ss) {
 	/* If ss->linewith is 0, its supposed to be a hairline - Gsk.Stroke doesn't have that
 	 * for now, we'll just hardcode .25 as size, but we might want to switch to a cairo node,
 	 * which has cairo_set_hairline.
@@ -236,22 +701,26 @@ static void phi_node_device_stroke_path(fz_context* ctx, fz_device* dev, const f
 	}
 	gsk_stroke_set_dash(stroke, ss->dash_list, ss->dash_len);
 	gsk_stroke_set_dash_offset(stroke, ss->dash_phase);
-	
-	GskPath* cpath = phi_node_device_convert_path(ctx, path);
+
+	return stroke;
+}
+
+static void phi_node_device_append_stroke(PhiNodeDevice* self, fz_context* ctx, GskPath* cpath, const fz_stroke_state* ss, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha) {
+	GskStroke* stroke = phi_node_device_convert_stroke(ctx, ss);
 	graphene_rect_t bounds;
 	if (!gsk_path_get_stroke_bounds(cpath, stroke, &bounds))
 		graphene_rect_init(&bounds, 0.f, 0.f, 0.f, 0.f);
-	GskRenderNode* fill = phi_node_device_make_color(ctx, cs, color, alpha, &bounds);
-	
-	GskRenderNode* node = gsk_stroke_node_new(fill, cpath, stroke);
+	GdkRGBA rgba;
+	phi_node_device_convert_color(ctx, cs, color, alpha, &rgba);
+	phi_node_device_batch(self, PHI_BATCH_KIND_STROKE, &rgba, &ctm, FALSE, stroke, cpath, &bounds);
 	gsk_stroke_free(stroke);
-	gsk_render_node_unref(fill);
-	gsk_path_unref(cpath);
-
-	node = phi_node_device_transform_child(node, &ctm);
+}
 
-	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
-	g_ptr_array_add(current->children, node);
+static void phi_node_device_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path, const fz_stroke_state* ss, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	GskPath* cpath = phi_node_device_lookup_path(ctx, self, path);
+	phi_node_device_append_stroke(self, ctx, cpath, ss, ctm, cs, color, alpha);
+	gsk_path_unref(cpath);
 }
 
 static void phi_node_device_clip_path(fz_context* ctx, fz_device* dev, const fz_path* path, int even_odd, fz_matrix ctm, fz_rect scissor) {
@@ -259,25 +728,44 @@ static void phi_node_device_clip_path(fz_context* ctx, fz_device* dev, const fz_
 
 	PhiRenderContext new;
 	phi_render_context_init(&new);
+
+	// clip nodes are a lot cheaper than masking with a fill node
+	if (phi_node_device_path_rounded_rect(ctx, path, ctm, &new.clip_rect.rect, &new.clip_rect.rounded)) {
+		new.state = PHI_RENDER_STATE_CLIP_RECT;
+		if (!new.clip_rect.rounded) {
+			graphene_rect_t clip;
+			graphene_rect_init(&clip, scissor.x0, scissor.y0, scissor.x1 - scissor.x0, scissor.y1 - scissor.y0);
+			if (!graphene_rect_intersection(&new.clip_rect.rect.bounds, &clip, &new.clip_rect.rect.bounds))
+				graphene_rect_init(&new.clip_rect.rect.bounds, 0, 0, 0, 0);
+		}
+		phi_node_device_push(self, &new);
+		return;
+	}
+
 	new.state = PHI_RENDER_STATE_CLIP_PATH_FILL;
-	new.clip_path_fill.path = phi_node_device_convert_path(ctx, path);
+	new.clip_path_fill.path = phi_node_device_lookup_path(ctx, self, path);
 	new.clip_path_fill.even_odd = even_odd;
 	new.clip_path_fill.ctm = ctm;
 	new.clip_path_fill.scissor = scissor;
 
-	g_array_append_val(self->stack, new);
+	phi_node_device_push(self, &new);
 }
 
-static void phi_node_device_clip_stroke_path(fz_context*, fz_device* dev, const fz_path*, const fz_stroke_state*, fz_matrix, fz_rect) {
-	PhiNodeDevice* self = (PhiNodeDevice*)dev;
-
-	g_critical("unimplemented: clip_stroke_path");
-	
+static void phi_node_device_push_clip_stroke(PhiNodeDevice* self, fz_context* ctx, GskPath* cpath, const fz_stroke_state* ss, fz_matrix ctm, fz_rect scissor) {
 	PhiRenderContext new;
 	phi_render_context_init(&new);
-	new.state = PHI_RENDER_STATE_NONE;
+	new.state = PHI_RENDER_STATE_CLIP_PATH_STROKE;
+	new.clip_path_stroke.path = cpath;
+	new.clip_path_stroke.stroke = phi_node_device_convert_stroke(ctx, ss);
+	new.clip_path_stroke.ctm = ctm;
+	new.clip_path_stroke.scissor = scissor;
 
-	g_array_append_val(self->stack, new);
+	phi_node_device_push(self, &new);
+}
+
+static void phi_node_device_clip_stroke_path(fz_context* ctx, fz_device* dev, const fz_path* path, const fz_stroke_state* ss, fz_matrix ctm, fz_rect scissor) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	phi_node_device_push_clip_stroke(self, ctx, phi_node_device_lookup_path(ctx, self, path), ss, ctm, scissor);
 }
 
 static GskRenderNode* phi_node_device_alpha(GskRenderNode* child, float alpha) {
@@ -290,32 +778,137 @@ static GskRenderNode* phi_node_device_alpha(GskRenderNode* child, float alpha) {
 
 typedef struct {
 	fz_context* ctx;
+	// the PhiContext ctx was cloned from, owns the lock table ctx uses
+	GObject* owner;
 	fz_pixmap* pixmap;
+	fz_image* image;
 } PhiPixmapStorage;
 static void phi_pixmap_storage_free(PhiPixmapStorage* self) {
 	fz_drop_pixmap(self->ctx, self->pixmap);
+	fz_drop_image(self->ctx, self->image);
 	fz_drop_context(self->ctx);
+	g_object_unref(self->owner);
 	g_free(self);
 }
-static GskRenderNode* phi_node_device_node_from_image(fz_context* ctx, fz_image* img, fz_matrix ctm) {
-	fz_pixmap* pixmap = fz_get_pixmap_from_image(ctx, img, NULL, NULL, NULL, NULL);
+
+guint phi_node_device_image_key_hash(const PhiNodeDeviceImageKey* key) {
+	guint hash = g_direct_hash(key->image);
+	hash = hash * 31 + (guint)key->level;
+	hash = hash * 31 + (guint)key->area.x0;
+	hash = hash * 31 + (guint)key->area.y0;
+	return hash;
+}
+gboolean phi_node_device_image_key_equal(const PhiNodeDeviceImageKey* a, const PhiNodeDeviceImageKey* b) {
+	return a->image == b->image && a->level == b->level &&
+	       a->area.x0 == b->area.x0 && a->area.y0 == b->area.y0 && a->area.x1 == b->area.x1 && a->area.y1 == b->area.y1;
+}
+void phi_node_device_image_key_free(PhiNodeDeviceImageKey* key) {
+	g_bytes_unref(key->storage);
+	g_free(key);
+}
+
+/* The number of times the image can be halved while still having enough
+ * pixels for the size it is drawn at. MuPDF can skip most of the work for
+ * these when decoding.
+ */
+static gint phi_node_device_image_level(fz_image* img, fz_matrix ctm) {
+	float width = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) * PHI_NODE_DEVICE_IMAGE_OVERSAMPLING;
+	float height = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) * PHI_NODE_DEVICE_IMAGE_OVERSAMPLING;
+	gint level = 0;
+	while (level < 16 && (img->w >> (level + 1)) >= width && (img->h >> (level + 1)) >= height)
+		level++;
+	return level;
+}
+
+/* Takes ownership of pixmap. The result is a new pixmap with 4 bytes per
+ * pixel, as decoded pixmaps may be shared through the fz_store.
+ */
+static fz_pixmap* phi_node_device_convert_cmyk(fz_context* ctx, fz_pixmap* pixmap, gboolean alpha) {
+	gint width = fz_pixmap_width(ctx, pixmap);
+	gint height = fz_pixmap_height(ctx, pixmap);
+	fz_pixmap* ret = NULL;
+	fz_try(ctx) {
+		// the alpha channel is X without alpha in the source
+		ret = fz_new_pixmap(ctx, fz_device_rgb(ctx), width, height, NULL, 1);
+		if (alpha)
+			phi_pixel_convert_cmyka_to_rgba(fz_pixmap_samples(ctx, pixmap), fz_pixmap_stride(ctx, pixmap), fz_pixmap_samples(ctx, ret), fz_pixmap_stride(ctx, ret), width, height);
+		else
+			phi_pixel_convert_cmyk_to_rgbx(fz_pixmap_samples(ctx, pixmap), fz_pixmap_stride(ctx, pixmap), fz_pixmap_samples(ctx, ret), fz_pixmap_stride(ctx, ret), width, height);
+	} fz_always(ctx) {
+		fz_drop_pixmap(ctx, pixmap);
+	} fz_catch(ctx) {
+		fz_rethrow(ctx);
+	}
+	return ret;
+}
+
+/* The conversion kernels only match MuPDF for DeviceCMYK without color
+ * management. Whether that is enabled isn't exposed, so it is told apart
+ * by how pure cyan converts: naively it is (0, 1, 1).
+ */
+static gboolean phi_node_device_cmyk_is_naive(fz_context* ctx, fz_colorspace* colorspace) {
+	if (colorspace != fz_device_cmyk(ctx))
+		return FALSE;
+	const float cyan[4] = { 1.f, 0.f, 0.f, 0.f };
+	float rgb[3];
+	fz_convert_color(ctx, colorspace, cyan, fz_device_rgb(ctx), rgb, NULL, fz_default_color_params);
+	return rgb[0] == 0.f && rgb[1] == 1.f && rgb[2] == 1.f;
+}
+
+// takes ownership of pixmap, storage is set to the memory backing the texture
+static GdkTexture* phi_node_device_texture_from_pixmap(fz_context* ctx, fz_pixmap* pixmap, fz_image* img, GBytes** storage) {
+	// spot colors and anything but RGB, gray or naive CMYK go through MuPDF's color conversion
+	fz_colorspace* colorspace = fz_pixmap_colorspace(ctx, pixmap);
+	if (fz_pixmap_spots(ctx, pixmap) > 0 || (colorspace && !fz_colorspace_is_rgb(ctx, colorspace) && !fz_colorspace_is_gray(ctx, colorspace) && !phi_node_device_cmyk_is_naive(ctx, colorspace))) {
+		fz_pixmap* converted = NULL;
+		fz_try(ctx) {
+			converted = fz_convert_pixmap(ctx, pixmap, fz_device_rgb(ctx), NULL, NULL, fz_default_color_params, 1);
+		} fz_always(ctx) {
+			fz_drop_pixmap(ctx, pixmap);
+		} fz_catch(ctx) {
+			fz_rethrow(ctx);
+		}
+		pixmap = converted;
+	}
+
 	gint components = fz_pixmap_components(ctx, pixmap);
 	gint colorants = fz_pixmap_colorants(ctx, pixmap);
 	gint spots = fz_pixmap_spots(ctx, pixmap);
 	gint alphas = fz_pixmap_alpha(ctx, pixmap);
-	if (components > 256)
+	if (components > 256) {
+		fz_drop_pixmap(ctx, pixmap);
 		fz_throw(ctx, FZ_ERROR_LIMIT, "Pixmap has too many components (%d)", components);
-	
+	}
+
+	// MuPDF pixmaps are 8 bit, with premultiplied alpha
 	guint32 fingerprint = (((guint8)components) << 24) | (((guint8)colorants) << 16) | (((guint8)spots) << 8) | ((guint8)alphas);
 	GdkMemoryFormat format;
 	switch (fingerprint) {
 		case 0x03030000:
 			format = GDK_MEMORY_R8G8B8;
 			break;
+		case 0x04030001:
+			format = GDK_MEMORY_R8G8B8A8_PREMULTIPLIED;
+			break;
+		case 0x01010000:
+			format = GDK_MEMORY_G8;
+			break;
+		case 0x02010001:
+			format = GDK_MEMORY_G8A8_PREMULTIPLIED;
+			break;
 		case 0x01000001:
 			format = GDK_MEMORY_A8;
 			break;
+		case 0x04040000:
+			pixmap = phi_node_device_convert_cmyk(ctx, pixmap, FALSE);
+			format = GDK_MEMORY_R8G8B8X8;
+			break;
+		case 0x05040001:
+			pixmap = phi_node_device_convert_cmyk(ctx, pixmap, TRUE);
+			format = GDK_MEMORY_R8G8B8A8_PREMULTIPLIED;
+			break;
 		default:
+			fz_drop_pixmap(ctx, pixmap);
 			fz_throw(ctx, FZ_ERROR_UNSUPPORTED, "Format of pixmap %p is unsupported (%x)", pixmap, fingerprint);
 	}
 
@@ -324,33 +917,129 @@ static GskRenderNode* phi_node_device_node_from_image(fz_context* ctx, fz_image*
 
 	PhiPixmapStorage *pixmap_store = g_new(PhiPixmapStorage, 1);
 	pixmap_store->ctx = fz_clone_context(ctx);
+	pixmap_store->owner = g_object_ref(fz_user_context(ctx));
 	pixmap_store->pixmap = pixmap; // takes ownership
+	pixmap_store->image = fz_keep_image(ctx, img);
+
+	*storage = g_bytes_new_with_free_func(fz_pixmap_samples(ctx, pixmap), fz_pixmap_size(ctx, pixmap), (GDestroyNotify)phi_pixmap_storage_free, pixmap_store);
+	return gdk_memory_texture_new(width, height, format, *storage, fz_pixmap_stride(ctx, pixmap));
+}
+
+/* Decodes area of img, in pixels at full resolution, into a texture node
+ * in that same pixel space. The textures are cached by image, resolution
+ * and area, so images reused across pages are decoded and uploaded only
+ * once.
+ */
+static GskRenderNode* phi_node_device_image_area(fz_context* ctx, const PhiNodeDeviceCaches* caches, fz_image* img, gint level, fz_irect area) {
+	PhiNodeDeviceImageKey lookup = {
+		.image = img,
+		.level = level,
+		.area = area
+	};
+	GskRenderNode* ret = caches->images ? phi_lru_cache_lookup(caches->images, &lookup) : NULL;
+	if (ret)
+		return ret;
 
-	GBytes* bytes = g_bytes_new_with_free_func(fz_pixmap_samples(ctx, pixmap), fz_pixmap_size(ctx, pixmap), (GDestroyNotify)phi_pixmap_storage_free, pixmap_store);
-	GdkTexture* texture = gdk_memory_texture_new(width, height, format, bytes, fz_pixmap_stride(ctx, pixmap));
-	g_bytes_unref(bytes);
-	GskRenderNode *texture_node = gsk_texture_node_new(texture, &GRAPHENE_RECT_INIT(0, 0, width, height));
+	gboolean whole = area.x0 == 0 && area.y0 == 0 && area.x1 == img->w && area.y1 == img->h;
+	// MuPDF picks the largest reduction that still results in at least this size
+	int w = MAX(1, img->w >> level);
+	int h = MAX(1, img->h >> level);
+	float sx = (float)img->w / w;
+	float sy = (float)img->h / h;
+	// the decoded area may be larger than requested, this is adjusted to place it
+	fz_matrix placement = fz_scale(w, h);
+	fz_pixmap* pixmap = fz_get_pixmap_from_image(ctx, img, whole ? NULL : &area, &placement, &w, &h);
+	fz_rect decoded = fz_transform_rect(fz_unit_rect, placement);
+
+	GBytes* storage;
+	GdkTexture* texture = phi_node_device_texture_from_pixmap(ctx, pixmap, img, &storage);
+	ret = gsk_texture_node_new(texture, &GRAPHENE_RECT_INIT(decoded.x0 * sx, decoded.y0 * sy, (decoded.x1 - decoded.x0) * sx, (decoded.y1 - decoded.y0) * sy));
 	g_object_unref(texture);
+	if (!whole) {
+		// neighbouring tiles must not overlap, or translucent images would be blended twice
+		GskRenderNode* clipped = gsk_clip_node_new(ret, &GRAPHENE_RECT_INIT(area.x0, area.y0, area.x1 - area.x0, area.y1 - area.y0));
+		gsk_render_node_unref(ret);
+		ret = clipped;
+	}
+
+	if (caches->images) {
+		PhiNodeDeviceImageKey* key = g_memdup2(&lookup, sizeof lookup);
+		key->storage = g_bytes_ref(storage);
+		phi_lru_cache_insert(caches->images, key, gsk_render_node_ref(ret), g_bytes_get_size(storage));
+	}
+	g_bytes_unref(storage);
+	return ret;
+}
+
+typedef void (*PhiNodeDeviceImageAreaFunc)(fz_context* ctx, fz_image* img, gint level, fz_irect area, gpointer user_data);
+
+/* Calls func for every area of img that has to be decoded at level to draw
+ * it with ctm. Images too large for a single texture are split into tiles, and
+ * only those intersecting visible are needed.
+ */
+static void phi_node_device_foreach_image_area(fz_context* ctx, fz_image* img, gint level, fz_matrix ctm, fz_rect visible, PhiNodeDeviceImageAreaFunc func, gpointer user_data) {
+	gint tile = PHI_NODE_DEVICE_IMAGE_TILE_SIZE << level;
+	if (img->w <= tile && img->h <= tile) {
+		func(ctx, img, level, fz_make_irect(0, 0, img->w, img->h), user_data);
+		return;
+	}
+
+	for (gint y = 0; y < img->h; y += tile) {
+		for (gint x = 0; x < img->w; x += tile) {
+			fz_irect area = fz_make_irect(x, y, MIN(x + tile, img->w), MIN(y + tile, img->h));
+			fz_rect unit = fz_make_rect((float)area.x0 / img->w, (float)area.y0 / img->h, (float)area.x1 / img->w, (float)area.y1 / img->h);
+			if (fz_is_empty_rect(fz_intersect_rect(fz_transform_rect(unit, ctm), visible)))
+				continue;
+			func(ctx, img, level, area, user_data);
+		}
+	}
+}
 
-	// mat = inv([width 0 0; 0 height 0; 0 0 1])*ctm
+typedef struct {
+	const PhiNodeDeviceCaches* caches;
+	// GPtrArray<GskRenderNode>
+	GPtrArray* tiles;
+} PhiNodeDeviceImageTiles;
+
+static void phi_node_device_collect_image_area(fz_context* ctx, fz_image* img, gint level, fz_irect area, gpointer user_data) {
+	PhiNodeDeviceImageTiles* data = user_data;
+	g_ptr_array_add(data->tiles, phi_node_device_image_area(ctx, data->caches, img, level, area));
+}
+
+// decodes img at the resolution it is drawn at
+static GskRenderNode* phi_node_device_node_from_image(fz_context* ctx, PhiNodeDevice* self, fz_image* img, fz_matrix ctm) {
+	PhiNodeDeviceImageTiles data = {
+		.caches = &self->caches,
+		.tiles = g_ptr_array_new_with_free_func((GDestroyNotify)gsk_render_node_unref)
+	};
+	fz_try(ctx) {
+		gint level = self->glyph_base > 0 ? 0 : phi_node_device_image_level(img, ctm);
+		phi_node_device_foreach_image_area(ctx, img, level, ctm, self->visible, phi_node_device_collect_image_area, &data);
+	} fz_catch(ctx) {
+		g_ptr_array_unref(data.tiles);
+		fz_rethrow(ctx);
+	}
+	GskRenderNode* node = data.tiles->len == 1 ? gsk_render_node_ref(g_ptr_array_index(data.tiles, 0)) : gsk_container_node_new((GskRenderNode**)data.tiles->pdata, data.tiles->len);
+	g_ptr_array_unref(data.tiles);
+
+	// mat = inv([img->w 0 0; 0 img->h 0; 0 0 1])*ctm
 	fz_matrix mat = fz_make_matrix(
-		ctm.a / width, ctm.b / width,
-		ctm.c / height, ctm.d / height,
+		ctm.a / img->w, ctm.b / img->w,
+		ctm.c / img->h, ctm.d / img->h,
 		ctm.e, ctm.f);
-	return phi_node_device_transform_child(texture_node, &mat);
+	return phi_node_device_transform_child(node, &mat);
 }
 
 static void phi_node_device_fill_image(fz_context* ctx, fz_device* dev, fz_image* img, fz_matrix ctm, float alpha, fz_color_params) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
-	GskRenderNode *node = phi_node_device_node_from_image(ctx, img, ctm);
+	GskRenderNode *node = phi_node_device_node_from_image(ctx, self, img, ctm);
 	node = phi_node_device_alpha(node, alpha);
-	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
-	g_ptr_array_add(current->children, node);
+	phi_node_device_append(self, node);
 }
 
 static void phi_node_device_clip_image_mask(fz_context* ctx, fz_device* dev, fz_image* img, fz_matrix ctm, fz_rect scissor) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
-	GskRenderNode *node = phi_node_device_node_from_image(ctx, img, ctm);
+	GskRenderNode *node = phi_node_device_node_from_image(ctx, self, img, ctm);
 
 	PhiRenderContext new;
 	phi_render_context_init(&new);
@@ -359,7 +1048,194 @@ static void phi_node_device_clip_image_mask(fz_context* ctx, fz_device* dev, fz_
 	new.mask.mode = GSK_MASK_MODE_ALPHA;
 	new.mask.scissor = scissor;
 
-	g_array_append_val(self->stack, new);
+	phi_node_device_push(self, &new);
+}
+
+static gboolean phi_node_device_stop_redundant(const GskColorStop* prev, const GskColorStop* stop, const GskColorStop* next) {
+	float t = (stop->offset - prev->offset) / (next->offset - prev->offset);
+	const float* a = (const float*)&prev->color;
+	const float* b = (const float*)&stop->color;
+	const float* c = (const float*)&next->color;
+	for (guint i = 0; i < 4; i++) {
+		if (fabsf(a[i] + (c[i] - a[i]) * t - b[i]) >= .5f / 255.f)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Samples the colors of an axial or radial shading along the line from p0
+ * to p1 in shading space, by letting MuPDF paint it into a single row of
+ * pixels. This evaluates the shading function and converts to RGB just
+ * like the draw device would. Missing extends are emulated with
+ * transparent stops at the ends, which GSK then pads with.
+ */
+static GskColorStop* phi_node_device_shade_stops(fz_context* ctx, fz_shade* shade, fz_point p0, fz_point p1, fz_color_params color_params, gsize* n_stops) {
+	float dx = p1.x - p0.x;
+	float dy = p1.y - p0.y;
+	float len2 = dx * dx + dy * dy;
+	// maps p0 to (0, 0.5) and p1 to (N, 0.5), perpendicular to the line is y
+	fz_matrix axis = fz_make_matrix(
+		PHI_NODE_DEVICE_SHADE_SAMPLES * dx / len2, -dy / len2,
+		PHI_NODE_DEVICE_SHADE_SAMPLES * dy / len2, dx / len2,
+		0, 0);
+	axis.e = -(axis.a * p0.x + axis.c * p0.y);
+	axis.f = -(axis.b * p0.x + axis.d * p0.y) + .5f;
+
+	fz_matrix inv;
+	if (fz_try_invert_matrix(&inv, shade->matrix) != 0)
+		fz_throw(ctx, FZ_ERROR_ARGUMENT, "Shading matrix is not invertible");
+
+	fz_irect bbox = fz_make_irect(0, 0, PHI_NODE_DEVICE_SHADE_SAMPLES, 1);
+	fz_pixmap* row = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 1);
+	fz_try(ctx) {
+		fz_clear_pixmap(ctx, row);
+		fz_paint_shade(ctx, shade, NULL, fz_concat(inv, axis), row, color_params, bbox, NULL, NULL);
+	} fz_catch(ctx) {
+		fz_drop_pixmap(ctx, row);
+		fz_rethrow(ctx);
+	}
+
+	GArray* stops = g_array_sized_new(FALSE, FALSE, sizeof(GskColorStop), PHI_NODE_DEVICE_SHADE_SAMPLES + 2);
+	const guint8* px = fz_pixmap_samples(ctx, row);
+	for (guint i = 0; i < PHI_NODE_DEVICE_SHADE_SAMPLES; i++, px += 4) {
+		GskColorStop stop = { .offset = (i + .5f) / PHI_NODE_DEVICE_SHADE_SAMPLES };
+		float a = px[3] / 255.f;
+		if (a > 0)
+			stop.color = (GdkRGBA){ px[0] / 255.f / a, px[1] / 255.f / a, px[2] / 255.f / a, a };
+		else
+			stop.color = (GdkRGBA){ 0, 0, 0, 0 };
+
+		// stops lying on the line between their neighbours don't add anything
+		if (stops->len >= 2 && phi_node_device_stop_redundant(&g_array_index(stops, GskColorStop, stops->len - 2), &g_array_index(stops, GskColorStop, stops->len - 1), &stop))
+			g_array_index(stops, GskColorStop, stops->len - 1) = stop;
+		else
+			g_array_append_val(stops, stop);
+	}
+	fz_drop_pixmap(ctx, row);
+
+	// the samples are at pixel centers, the ends extend to the whole range
+	g_array_index(stops, GskColorStop, 0).offset = 0;
+	g_array_index(stops, GskColorStop, stops->len - 1).offset = 1;
+	if (!shade->u.l_or_r.extend[0]) {
+		GskColorStop edge = g_array_index(stops, GskColorStop, 0);
+		edge.color.alpha = 0;
+		g_array_prepend_val(stops, edge);
+	}
+	if (!shade->u.l_or_r.extend[1]) {
+		GskColorStop edge = g_array_index(stops, GskColorStop, stops->len - 1);
+		edge.color.alpha = 0;
+		g_array_append_val(stops, edge);
+	}
+
+	*n_stops = stops->len;
+	return (GskColorStop*)g_array_free(stops, FALSE);
+}
+
+/* Shadings GSK has no node for are painted by MuPDF into a texture, at
+ * the same resolution images are decoded at.
+ */
+static GskRenderNode* phi_node_device_shade_raster(fz_context* ctx, fz_shade* shade, fz_matrix ctm, fz_rect area, fz_color_params color_params) {
+	float scale = PHI_NODE_DEVICE_IMAGE_OVERSAMPLING;
+	float max = MAX(area.x1 - area.x0, area.y1 - area.y0) * scale;
+	if (max > PHI_NODE_DEVICE_IMAGE_TILE_SIZE)
+		scale *= PHI_NODE_DEVICE_IMAGE_TILE_SIZE / max;
+
+	fz_matrix scaled = fz_post_scale(ctm, scale, scale);
+	fz_irect bbox = fz_round_rect(fz_transform_rect(area, fz_scale(scale, scale)));
+	if (fz_is_empty_irect(bbox))
+		return gsk_container_node_new(NULL, 0);
+	fz_pixmap* pixmap = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 1);
+	fz_try(ctx) {
+		fz_clear_pixmap(ctx, pixmap);
+		fz_paint_shade(ctx, shade, NULL, scaled, pixmap, color_params, bbox, NULL, NULL);
+	} fz_catch(ctx) {
+		fz_drop_pixmap(ctx, pixmap);
+		fz_rethrow(ctx);
+	}
+
+	GBytes* storage;
+	GdkTexture* texture = phi_node_device_texture_from_pixmap(ctx, pixmap, NULL, &storage);
+	g_bytes_unref(storage);
+	GskRenderNode* ret = gsk_texture_node_new(texture, &GRAPHENE_RECT_INIT(bbox.x0 / scale, bbox.y0 / scale, (bbox.x1 - bbox.x0) / scale, (bbox.y1 - bbox.y0) / scale));
+	g_object_unref(texture);
+	return ret;
+}
+
+// the innermost clip in device space, shadings without bbox fill all of it
+static fz_rect phi_node_device_current_scissor(PhiNodeDevice* self) {
+	// clips outside of a glyph recording are in another space
+	for (guint i = self->stack->len; i-- > self->glyph_base;) {
+		const PhiRenderContext* entry = &g_array_index(self->stack, PhiRenderContext, i);
+		switch (entry->state) {
+			case PHI_RENDER_STATE_CLIP_PATH_FILL:
+				return entry->clip_path_fill.scissor;
+			case PHI_RENDER_STATE_CLIP_PATH_STROKE:
+				return entry->clip_path_stroke.scissor;
+			case PHI_RENDER_STATE_CLIP_RECT: {
+				const graphene_rect_t* r = &entry->clip_rect.rect.bounds;
+				return fz_make_rect(r->origin.x, r->origin.y, r->origin.x + r->size.width, r->origin.y + r->size.height);
+			}
+			case PHI_RENDER_STATE_MASK:
+				return entry->mask.scissor;
+			case PHI_RENDER_STATE_IN_MASK:
+				return entry->in_mask.area;
+			case PHI_RENDER_STATE_NONE:
+				break;
+		}
+	}
+	return fz_infinite_rect;
+}
+
+static void phi_node_device_fill_shade(fz_context* ctx, fz_device* dev, fz_shade* shade, fz_matrix ctm, float alpha, fz_color_params color_params) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	fz_rect area = fz_intersect_rect(fz_bound_shade(ctx, shade, ctm), self->visible);
+	area = fz_intersect_rect(area, phi_node_device_current_scissor(self));
+	if (fz_is_empty_rect(area))
+		return;
+	if (fz_is_infinite_rect(area)) {
+		fz_warn(ctx, "Ignoring unbounded shading");
+		return;
+	}
+
+	// shading space to device space
+	fz_matrix local = fz_concat(shade->matrix, ctm);
+	fz_matrix inv;
+	gboolean invertible = fz_try_invert_matrix(&inv, local) == 0;
+	float (*coords)[3] = shade->u.l_or_r.coords;
+
+	GskRenderNode* node = NULL;
+	if (invertible && shade->type == FZ_LINEAR && (coords[0][0] != coords[1][0] || coords[0][1] != coords[1][1])) {
+		gsize n_stops;
+		GskColorStop* stops = phi_node_device_shade_stops(ctx, shade, fz_make_point(coords[0][0], coords[0][1]), fz_make_point(coords[1][0], coords[1][1]), color_params, &n_stops);
+		fz_rect bounds = fz_transform_rect(area, inv);
+		node = gsk_linear_gradient_node_new(&GRAPHENE_RECT_INIT(bounds.x0, bounds.y0, bounds.x1 - bounds.x0, bounds.y1 - bounds.y0),
+			&GRAPHENE_POINT_INIT(coords[0][0], coords[0][1]), &GRAPHENE_POINT_INIT(coords[1][0], coords[1][1]), stops, n_stops);
+		g_free(stops);
+	} else if (invertible && shade->type == FZ_RADIAL && coords[0][0] == coords[1][0] && coords[0][1] == coords[1][1] && coords[0][2] >= 0 && coords[0][2] < coords[1][2]) {
+		// only concentric circles with a growing radius map onto a radial gradient
+		float r0 = coords[0][2];
+		float r1 = coords[1][2];
+		fz_point center = fz_make_point(coords[0][0], coords[0][1]);
+		gsize n_stops;
+		GskColorStop* stops = phi_node_device_shade_stops(ctx, shade, fz_make_point(center.x + r0, center.y), fz_make_point(center.x + r1, center.y), color_params, &n_stops);
+		fz_rect bounds = fz_transform_rect(area, inv);
+		node = gsk_radial_gradient_node_new(&GRAPHENE_RECT_INIT(bounds.x0, bounds.y0, bounds.x1 - bounds.x0, bounds.y1 - bounds.y0),
+			&GRAPHENE_POINT_INIT(center.x, center.y), r1, r1, r0 / r1, 1, stops, n_stops);
+		g_free(stops);
+	}
+
+	if (node) {
+		node = phi_node_device_transform_child(node, &local);
+		// bounds were a bounding box in shading space, which is larger when rotated
+		GskRenderNode* clipped = gsk_clip_node_new(node, &GRAPHENE_RECT_INIT(area.x0, area.y0, area.x1 - area.x0, area.y1 - area.y0));
+		gsk_render_node_unref(node);
+		node = clipped;
+	} else {
+		node = phi_node_device_shade_raster(ctx, shade, ctm, area, color_params);
+	}
+
+	node = phi_node_device_alpha(node, alpha);
+	phi_node_device_append(self, node);
 }
 
 static GskRenderNode* phi_node_device_scissor_clip(GskRenderNode* child, const fz_rect* clip) {
@@ -376,14 +1252,10 @@ static void phi_node_device_pop_clip(fz_context* ctx, fz_device* dev) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
 	if (self->stack->len < 2)
 		fz_throw(ctx, FZ_ERROR_ARGUMENT, "fz_pop_clip called on root");
+	phi_node_device_flush(self);
 
 	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
-
-	GskRenderNode* node;
-	if (current->children->len == 1)
-		node = gsk_render_node_ref(g_ptr_array_index(current->children, 0));
-	else
-		node = gsk_container_node_new((GskRenderNode**)current->children->pdata, current->children->len);
+	GskRenderNode* node = phi_render_context_collapse(current);
 	
 	switch (current->state) {
 		case PHI_RENDER_STATE_NONE:
@@ -397,6 +1269,27 @@ static void phi_node_device_pop_clip(fz_context* ctx, fz_device* dev) {
 			node = phi_node_device_node_from_fillpath(node, current->clip_path_fill.path, current->clip_path_fill.even_odd, &inv, &current->clip_path_fill.ctm);
 			node = phi_node_device_scissor_clip(node, &current->clip_path_fill.scissor);
 		} break;
+		case PHI_RENDER_STATE_CLIP_PATH_STROKE: {
+			fz_matrix inv;
+			if (fz_try_invert_matrix(&inv, current->clip_path_stroke.ctm) != 0) {
+				fz_warn(ctx, "Failed to invert matrix, using identity");
+				inv = fz_identity;
+			}
+			// a stroke node draws its child only where the stroke covers it
+			GskRenderNode* child = phi_node_device_transform_child(node, &inv);
+			node = gsk_stroke_node_new(child, current->clip_path_stroke.path, current->clip_path_stroke.stroke);
+			gsk_render_node_unref(child);
+			node = phi_node_device_transform_child(node, &current->clip_path_stroke.ctm);
+			node = phi_node_device_scissor_clip(node, &current->clip_path_stroke.scissor);
+		} break;
+		case PHI_RENDER_STATE_CLIP_RECT: {
+			GskRenderNode* child = node;
+			if (current->clip_rect.rounded)
+				node = gsk_rounded_clip_node_new(child, &current->clip_rect.rect);
+			else
+				node = gsk_clip_node_new(child, &current->clip_rect.rect.bounds);
+			gsk_render_node_unref(child);
+		} break;
 		case PHI_RENDER_STATE_MASK: {
 			GskRenderNode *source = node;
 			node = gsk_mask_node_new(source, current->mask.mask, current->mask.mode);
@@ -423,21 +1316,18 @@ static void phi_node_device_begin_mask(fz_context*, fz_device* dev, fz_rect area
 	new.in_mask.mask_mode = luminosity ? GSK_MASK_MODE_LUMINANCE : GSK_MASK_MODE_ALPHA;
 	new.in_mask.area = area;
 
-	g_array_append_val(self->stack, new);
+	phi_node_device_push(self, &new);
 }
 
 static void phi_node_device_end_mask(fz_context* ctx, fz_device* dev, fz_function*) {
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	phi_node_device_flush(self);
 	
 	PhiRenderContext* current = &g_array_index(self->stack, PhiRenderContext, self->stack->len - 1);
 	if (current->state != PHI_RENDER_STATE_IN_MASK)
 		fz_throw(ctx, FZ_ERROR_ARGUMENT, "end_mask called in invalid state");
 	
-	GskRenderNode* node;
-	if (current->children->len == 1)
-		node = gsk_render_node_ref(g_ptr_array_index(current->children, 0));
-	else
-		node = gsk_container_node_new((GskRenderNode**)current->children->pdata, current->children->len);
+	GskRenderNode* node = phi_render_context_collapse(current);
 
 	PhiRenderContext new;
 	phi_render_context_init(&new);
@@ -447,25 +1337,314 @@ static void phi_node_device_end_mask(fz_context* ctx, fz_device* dev, fz_functio
 	new.mask.scissor = current->in_mask.area;
 
 	g_array_remove_index(self->stack, self->stack->len - 1);
-	g_array_append_val(self->stack, new);
+	phi_node_device_push(self, &new);
+}
+
+/* Lays out the glyphs of span in a space in which the font is upright,
+ * PHI_FONT_CACHE_FONT_SIZE pixels large and the y axis points down, so
+ * GSK can draw them from its glyph cache. The returned node is already
+ * transformed back into the space of ctm.
+ */
+static GskRenderNode* phi_node_device_text_span_node(fz_context* ctx, PangoFont* font, const fz_text_span* span, fz_matrix ctm, const GdkRGBA* color) {
+	fz_matrix trm = span->trm;
+	trm.e = trm.f = 0.f;
+	fz_matrix local = fz_concat(fz_concat(fz_scale(1.f / PHI_FONT_CACHE_FONT_SIZE, -1.f / PHI_FONT_CACHE_FONT_SIZE), trm), ctm);
+	fz_matrix inv;
+	if (fz_try_invert_matrix(&inv, local) != 0)
+		return NULL;
+
+	PangoGlyphString* glyphs = pango_glyph_string_new();
+	pango_glyph_string_set_size(glyphs, span->len);
+	gint n_glyphs = 0;
+	graphene_point_t offset = GRAPHENE_POINT_INIT(0.f, 0.f);
+	gint x = 0;
+	for (gint i = 0; i < span->len; i++) {
+		if (span->items[i].gid < 0)
+			continue;
+		fz_point origin = fz_transform_point(fz_transform_point_xy(span->items[i].x, span->items[i].y, ctm), inv);
+		if (n_glyphs == 0)
+			offset.x = origin.x;
+
+		// glyph positions accumulate the widths of the previous glyphs
+		gint glyph_x = (origin.x - offset.x) * PANGO_SCALE;
+		if (n_glyphs > 0)
+			glyphs->glyphs[n_glyphs - 1].geometry.width = glyph_x - x;
+		x = glyph_x;
+
+		PangoGlyphInfo* info = &glyphs->glyphs[n_glyphs++];
+		info->glyph = span->items[i].gid;
+		info->geometry.width = 0;
+		info->geometry.x_offset = 0;
+		info->geometry.y_offset = origin.y * PANGO_SCALE;
+		info->attr.is_cluster_start = 1;
+		info->attr.is_color = 0;
+	}
+	pango_glyph_string_set_size(glyphs, n_glyphs);
+
+	GskRenderNode* node = n_glyphs > 0 ? gsk_text_node_new(font, glyphs, color, &offset) : NULL;
+	pango_glyph_string_free(glyphs);
+	if (!node)
+		return NULL;
+	return phi_node_device_transform_child(node, &local);
+}
+
+// Outlines of all glyphs of span in user space, Type 3 glyphs have none
+static GskPath* phi_node_device_text_span_outline(fz_context* ctx, const fz_text_span* span) {
+	GskPathBuilder* builder = gsk_path_builder_new();
+	fz_path* path = NULL;
+	fz_var(path);
+	fz_try(ctx) {
+		for (gint i = 0; i < span->len; i++) {
+			if (span->items[i].gid < 0)
+				continue;
+			fz_matrix trm = span->trm;
+			trm.e = span->items[i].x;
+			trm.f = span->items[i].y;
+			path = fz_outline_glyph(ctx, span->font, span->items[i].gid, trm);
+			if (path)
+				fz_walk_path(ctx, path, &phi_node_device_path_walker, builder);
+			fz_drop_path(ctx, path);
+			path = NULL;
+		}
+	} fz_catch(ctx) {
+		fz_drop_path(ctx, path);
+		gsk_path_builder_unref(builder);
+		fz_rethrow(ctx);
+	}
+	return gsk_path_builder_free_to_path(builder);
+}
+
+// Outline of a glyph in glyph space, empty if it has none
+static GskPath* phi_node_device_glyph_outline(fz_context* ctx, PhiNodeDevice* self, fz_font* font, gint gid) {
+	GskPath* path = self->caches.fonts ? phi_font_cache_lookup_outline(self->caches.fonts, ctx, font, gid) : NULL;
+	if (path)
+		return path;
+
+	fz_path* outline = fz_outline_glyph(ctx, font, gid, fz_identity);
+	if (outline) {
+		path = phi_node_device_convert_path(ctx, outline);
+		fz_drop_path(ctx, outline);
+	} else {
+		path = gsk_path_builder_free_to_path(gsk_path_builder_new());
+	}
+
+	if (self->caches.fonts)
+		phi_font_cache_insert_outline(self->caches.fonts, ctx, font, gid, gsk_path_ref(path));
+	return path;
+}
+
+static GskRenderNode* phi_node_device_outline_glyph_node(fz_context* ctx, PhiNodeDevice* self, fz_font* font, gint gid, fz_colorspace* cs, const float* color, float alpha) {
+	GskPath* path = phi_node_device_glyph_outline(ctx, self, font, gid);
+	graphene_rect_t bounds;
+	if (!gsk_path_get_bounds(path, &bounds)) {
+		gsk_path_unref(path);
+		return NULL;
+	}
+	GskRenderNode* fill = phi_node_device_make_color(ctx, cs, color, alpha, &bounds);
+	GskRenderNode* node = gsk_fill_node_new(fill, path, GSK_FILL_RULE_WINDING);
+	gsk_render_node_unref(fill);
+	gsk_path_unref(path);
+	return node;
+}
+
+static GskRenderNode* phi_node_device_type3_glyph_node(fz_context* ctx, PhiNodeDevice* self, fz_font* font, gint gid, fz_colorspace* cs, const float* color, float alpha) {
+	GskRenderNode* glyph = self->caches.fonts ? phi_font_cache_lookup_glyph(self->caches.fonts, ctx, font, gid) : NULL;
+	if (!glyph) {
+		PhiRenderContext record;
+		phi_render_context_init(&record);
+		phi_node_device_push(self, &record);
+		guint depth = self->stack->len;
+		fz_rect visible = self->visible;
+		guint glyph_base = self->glyph_base;
+		self->visible = fz_infinite_rect;
+		self->glyph_base = depth - 1;
+		fz_try(ctx) {
+			fz_run_t3_glyph(ctx, font, gid, fz_identity, (fz_device*)self);
+			phi_node_device_flush(self);
+		} fz_always(ctx) {
+			self->visible = visible;
+			self->glyph_base = glyph_base;
+		} fz_catch(ctx) {
+			// pending draws and clips the glyph left open belong to the aborted recording
+			phi_batch_reset(&self->batch);
+			g_array_set_size(self->stack, depth - 1);
+			fz_rethrow(ctx);
+		}
+		glyph = phi_render_context_collapse(&g_array_index(self->stack, PhiRenderContext, self->stack->len - 1));
+		g_array_remove_index(self->stack, self->stack->len - 1);
+
+		if (self->caches.fonts)
+			phi_font_cache_insert_glyph(self->caches.fonts, ctx, font, gid, gsk_render_node_ref(glyph));
+	}
+
+	// glyphs defined with d1 carry no color of their own and only act as a mask for the fill color
+	gboolean uncolored = font->t3flags && (font->t3flags[gid] & FZ_DEVFLAG_MASK) && !(font->t3flags[gid] & FZ_DEVFLAG_COLOR);
+	if (!uncolored)
+		return glyph;
+
+	graphene_rect_t bounds;
+	gsk_render_node_get_bounds(glyph, &bounds);
+	GskRenderNode* fill = phi_node_device_make_color(ctx, cs, color, alpha, &bounds);
+	GskRenderNode* node = gsk_mask_node_new(fill, glyph, GSK_MASK_MODE_ALPHA);
+	gsk_render_node_unref(fill);
+	gsk_render_node_unref(glyph);
+	return node;
+}
+
+static void phi_node_device_node_unref_nullable(GskRenderNode* node) {
+	if (node)
+		gsk_render_node_unref(node);
 }
 
-fz_device* phi_node_device_new(fz_context* ctx) {
+/* Draws every glyph of span as geometry. Each distinct glyph is converted
+ * once, every occurrence is just a transform node referencing it.
+ */
+static void phi_node_device_fill_text_span_glyphs(fz_context* ctx, PhiNodeDevice* self, const fz_text_span* span, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha) {
+	// GHashTable<glyph id, GskRenderNode>, NULL for glyphs without any geometry
+	GHashTable* shared = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)phi_node_device_node_unref_nullable);
+	fz_try(ctx) {
+		for (gint i = 0; i < span->len; i++) {
+			gint gid = span->items[i].gid;
+			if (gid < 0)
+				continue;
+
+			GskRenderNode* glyph;
+			if (!g_hash_table_lookup_extended(shared, GINT_TO_POINTER(gid), NULL, (gpointer*)&glyph)) {
+				if (span->font->t3procs)
+					glyph = phi_node_device_type3_glyph_node(ctx, self, span->font, gid, cs, color, alpha);
+				else
+					glyph = phi_node_device_outline_glyph_node(ctx, self, span->font, gid, cs, color, alpha);
+				g_hash_table_insert(shared, GINT_TO_POINTER(gid), glyph);
+			}
+			if (!glyph)
+				continue;
+
+			fz_matrix trm = span->trm;
+			trm.e = span->items[i].x;
+			trm.f = span->items[i].y;
+			trm = fz_concat(trm, ctm);
+			phi_node_device_append(self, phi_node_device_transform_child(gsk_render_node_ref(glyph), &trm));
+		}
+	} fz_always(ctx) {
+		g_hash_table_unref(shared);
+	} fz_catch(ctx) {
+		fz_rethrow(ctx);
+	}
+}
+
+static void phi_node_device_font_unref_nullable(PangoFont* font) {
+	if (font)
+		g_object_unref(font);
+}
+
+// remembers the fonts of this conversion, so the font cache lock is only taken once per font
+static PangoFont* phi_node_device_font(PhiNodeDevice* self, fz_context* ctx, fz_font* font) {
+	if (!self->caches.fonts || font->t3procs)
+		return NULL;
+	PangoFont* ret;
+	if (g_hash_table_lookup_extended(self->fonts, font, NULL, (gpointer*)&ret))
+		return ret;
+	ret = phi_font_cache_lookup(self->caches.fonts, ctx, font);
+	g_hash_table_insert(self->fonts, font, ret);
+	return ret;
+}
+
+static void phi_node_device_fill_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+
+	GdkRGBA rgba;
+	phi_node_device_convert_color(ctx, cs, color, alpha, &rgba);
+
+	for (const fz_text_span* span = text->head; span; span = span->next) {
+		PangoFont* font = phi_node_device_font(self, ctx, span->font);
+		if (font) {
+			// text nodes measure their glyphs, which isn't thread-safe
+			phi_font_cache_lock_font(font);
+			GskRenderNode* node = phi_node_device_text_span_node(ctx, font, span, ctm, &rgba);
+			phi_font_cache_unlock_font(font);
+			if (node)
+				phi_node_device_append(self, node);
+			continue;
+		}
+
+		phi_node_device_fill_text_span_glyphs(ctx, self, span, ctm, cs, color, alpha);
+	}
+}
+
+// GSK can't stroke glyphs from its cache, so stroked text always uses the outlines
+static void phi_node_device_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text, const fz_stroke_state* ss, fz_matrix ctm, fz_colorspace* cs, const float* color, float alpha, fz_color_params) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	for (const fz_text_span* span = text->head; span; span = span->next) {
+		GskPath* path = phi_node_device_text_span_outline(ctx, span);
+		phi_node_device_append_stroke(self, ctx, path, ss, ctm, cs, color, alpha);
+		gsk_path_unref(path);
+	}
+}
+
+static void phi_node_device_clip_text(fz_context* ctx, fz_device* dev, const fz_text* text, fz_matrix ctm, fz_rect scissor) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+
+	GskPathBuilder* builder = gsk_path_builder_new();
+	for (const fz_text_span* span = text->head; span; span = span->next) {
+		GskPath* path = phi_node_device_text_span_outline(ctx, span);
+		gsk_path_builder_add_path(builder, path);
+		gsk_path_unref(path);
+	}
+
+	PhiRenderContext new;
+	phi_render_context_init(&new);
+	new.state = PHI_RENDER_STATE_CLIP_PATH_FILL;
+	new.clip_path_fill.path = gsk_path_builder_free_to_path(builder);
+	new.clip_path_fill.even_odd = FALSE;
+	new.clip_path_fill.ctm = ctm;
+	new.clip_path_fill.scissor = scissor;
+
+	phi_node_device_push(self, &new);
+}
+
+static void phi_node_device_clip_stroke_text(fz_context* ctx, fz_device* dev, const fz_text* text, const fz_stroke_state* ss, fz_matrix ctm, fz_rect scissor) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+
+	GskPathBuilder* builder = gsk_path_builder_new();
+	for (const fz_text_span* span = text->head; span; span = span->next) {
+		GskPath* path = phi_node_device_text_span_outline(ctx, span);
+		gsk_path_builder_add_path(builder, path);
+		gsk_path_unref(path);
+	}
+
+	phi_node_device_push_clip_stroke(self, ctx, gsk_path_builder_free_to_path(builder), ss, ctm, scissor);
+}
+
+fz_device* phi_node_device_new(fz_context* ctx, const PhiNodeDeviceCaches* caches) {
 	PhiNodeDevice* self = fz_new_derived_device(ctx, PhiNodeDevice);
 	self->stack = g_array_new(FALSE, FALSE, sizeof(PhiRenderContext));
 	g_array_set_clear_func(self->stack, (GDestroyNotify)phi_render_context_clear);
+	if (caches)
+		self->caches = *caches;
+	else
+		self->caches = (PhiNodeDeviceCaches){ 0 };
+	self->visible = fz_infinite_rect;
+	self->fonts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)phi_node_device_font_unref_nullable);
 
 	self->super.drop_device = phi_node_device_drop;
 	self->super.fill_path = phi_node_device_fill_path;
 	self->super.stroke_path = phi_node_device_stroke_path;
 	self->super.clip_path = phi_node_device_clip_path;
 	self->super.clip_stroke_path = phi_node_device_clip_stroke_path;
+	self->super.fill_text = phi_node_device_fill_text;
+	self->super.stroke_text = phi_node_device_stroke_text;
+	self->super.clip_text = phi_node_device_clip_text;
+	self->super.clip_stroke_text = phi_node_device_clip_stroke_text;
 	self->super.fill_image = phi_node_device_fill_image;
 	self->super.clip_image_mask = phi_node_device_clip_image_mask;
+	self->super.fill_shade = phi_node_device_fill_shade;
 	self->super.pop_clip = phi_node_device_pop_clip;
 	self->super.begin_mask = phi_node_device_begin_mask;
 	self->super.end_mask = phi_node_device_end_mask;
 
+	self->batch.bounds = g_array_new(FALSE, FALSE, sizeof(graphene_rect_t));
+	phi_batch_reset(&self->batch);
+
 	PhiRenderContext root;
 	phi_render_context_init(&root);
 	g_array_append_val(self->stack, root);
@@ -473,11 +1652,221 @@ fz_device* phi_node_device_new(fz_context* ctx) {
 	return (fz_device*)self;
 }
 
+// the decode jobs of one conversion, which waits until all of them are done
+typedef struct {
+	GMutex lock;
+	GCond done;
+	guint pending;
+} PhiImageDecodeBatch;
+
+typedef struct {
+	PhiImageDecodeBatch* batch;
+	fz_context* ctx;
+	fz_cookie* cookie;
+	const PhiNodeDeviceCaches* caches;
+	fz_image* image;
+	gint level;
+	fz_irect area;
+} PhiImageDecodeJob;
+
+// only for jobs that never ran
+static void phi_image_decode_job_free(PhiImageDecodeJob* job) {
+	fz_drop_image(job->ctx, job->image);
+	fz_drop_context(job->ctx);
+	g_free(job);
+}
+
+void phi_node_device_decode_job_run(gpointer data, gpointer) {
+	PhiImageDecodeJob* job = data;
+	PhiImageDecodeBatch* batch = job->batch;
+	if (!job->cookie || !job->cookie->abort) {
+		fz_try(job->ctx) {
+			gsk_render_node_unref(phi_node_device_image_area(job->ctx, job->caches, job->image, job->level, job->area));
+		} fz_catch(job->ctx) {
+			// the conversion tries again and reports the error
+			g_debug("Failed to decode image ahead of time: %s", fz_caught_message(job->ctx));
+		}
+	}
+	phi_image_decode_job_free(job);
+
+	g_mutex_lock(&batch->lock);
+	if (--batch->pending == 0)
+		g_cond_signal(&batch->done);
+	g_mutex_unlock(&batch->lock);
+}
+
+/* Only records which image areas are needed, so they can be decoded
+ * up front in parallel, instead of one after another during conversion.
+ */
+typedef struct {
+	fz_device super;
+	const PhiNodeDeviceCaches* caches;
+	fz_rect visible;
+	// GHashSet<PhiNodeDeviceImageKey>, without storage
+	GHashTable* queued;
+	// GPtrArray<PhiImageDecodeJob>
+	GPtrArray* jobs;
+} PhiImageCollector;
+
+static void phi_image_collector_add(fz_context* ctx, fz_image* img, gint level, fz_irect area, gpointer user_data) {
+	PhiImageCollector* self = user_data;
+	PhiNodeDeviceImageKey lookup = {
+		.image = img,
+		.level = level,
+		.area = area
+	};
+	if (g_hash_table_contains(self->queued, &lookup))
+		return;
+	GskRenderNode* cached = phi_lru_cache_lookup(self->caches->images, &lookup);
+	if (cached) {
+		gsk_render_node_unref(cached);
+		return;
+	}
+	g_hash_table_add(self->queued, g_memdup2(&lookup, sizeof lookup));
+
+	PhiImageDecodeJob* job = g_new(PhiImageDecodeJob, 1);
+	job->batch = NULL;
+	job->ctx = fz_clone_context(ctx);
+	if (!job->ctx) {
+		g_free(job);
+		return;
+	}
+	job->cookie = NULL;
+	job->caches = self->caches;
+	job->image = fz_keep_image(ctx, img);
+	job->level = level;
+	job->area = area;
+	g_ptr_array_add(self->jobs, job);
+}
+static void phi_image_collector_fill_image(fz_context* ctx, fz_device* dev, fz_image* img, fz_matrix ctm, float, fz_color_params) {
+	PhiImageCollector* self = (PhiImageCollector*)dev;
+	phi_node_device_foreach_image_area(ctx, img, phi_node_device_image_level(img, ctm), ctm, self->visible, phi_image_collector_add, self);
+}
+static void phi_image_collector_clip_image_mask(fz_context* ctx, fz_device* dev, fz_image* img, fz_matrix ctm, fz_rect) {
+	PhiImageCollector* self = (PhiImageCollector*)dev;
+	phi_node_device_foreach_image_area(ctx, img, phi_node_device_image_level(img, ctm), ctm, self->visible, phi_image_collector_add, self);
+}
+
+/* Decodes the images drawn by list within visible into the image cache
+ * on all cores, so converting list afterwards finds them there.
+ */
+void phi_node_device_decode_images(fz_context* ctx, fz_display_list* list, fz_rect visible, const PhiNodeDeviceCaches* caches, fz_cookie* cookie) {
+	if (!caches || !caches->images)
+		return;
+
+	PhiImageCollector* collector = fz_new_derived_device(ctx, PhiImageCollector);
+	collector->super.fill_image = phi_image_collector_fill_image;
+	collector->super.clip_image_mask = phi_image_collector_clip_image_mask;
+	collector->caches = caches;
+	collector->visible = visible;
+	collector->queued = g_hash_table_new_full((GHashFunc)phi_node_device_image_key_hash, (GEqualFunc)phi_node_device_image_key_equal, g_free, NULL);
+	collector->jobs = g_ptr_array_new_with_free_func((GDestroyNotify)phi_image_decode_job_free);
+
+	GPtrArray* jobs = collector->jobs;
+	fz_try(ctx) {
+		fz_run_display_list(ctx, list, &collector->super, fz_identity, visible, cookie);
+		fz_close_device(ctx, &collector->super);
+	} fz_always(ctx) {
+		g_hash_table_unref(collector->queued);
+		fz_drop_device(ctx, &collector->super);
+	} fz_catch(ctx) {
+		g_ptr_array_unref(jobs);
+		fz_rethrow(ctx);
+	}
+
+	PhiContext* context = fz_user_context(ctx);
+	// a single image is decoded just as fast during conversion
+	if (jobs->len < 2 || !context || !context->decode_pool) {
+		g_ptr_array_unref(jobs);
+		return;
+	}
+
+	PhiImageDecodeBatch batch;
+	g_mutex_init(&batch.lock);
+	g_cond_init(&batch.done);
+	batch.pending = jobs->len;
+
+	// the pool frees the jobs
+	g_ptr_array_set_free_func(jobs, NULL);
+	for (guint i = 0; i < jobs->len; i++) {
+		PhiImageDecodeJob* job = g_ptr_array_index(jobs, i);
+		job->batch = &batch;
+		job->cookie = cookie;
+		g_thread_pool_push(context->decode_pool, job, NULL);
+	}
+	g_ptr_array_unref(jobs);
+
+	g_mutex_lock(&batch.lock);
+	while (batch.pending > 0)
+		g_cond_wait(&batch.done, &batch.lock);
+	g_mutex_unlock(&batch.lock);
+	g_cond_clear(&batch.done);
+	g_mutex_clear(&batch.lock);
+}
+
+// in device space, for conversions of only part of a page
+void phi_node_device_set_visible_area(fz_device* dev, fz_rect area) {
+	PhiNodeDevice* self = (PhiNodeDevice*)dev;
+	self->visible = area;
+}
+
 GskRenderNode* phi_node_device_pop_root(fz_device* dev) {
 	g_return_val_if_fail(dev->drop_device == phi_node_device_drop, NULL);
 	PhiNodeDevice* self = (PhiNodeDevice*)dev;
 	g_return_val_if_fail(self->stack->len == 1, NULL);
 
+	phi_node_device_flush(self);
 	PhiRenderContext* root = &g_array_index(self->stack, PhiRenderContext, 0);
-	return gsk_container_node_new ((GskRenderNode**)root->children->pdata, root->children->len);
+	GskRenderNode* node = gsk_container_node_new ((GskRenderNode**)root->children->pdata, root->children->len);
+	GskRenderNode* ret = phi_node_optimize(node);
+	gsk_render_node_unref(node);
+	return ret;
+}
+
+/* Rough estimate of the memory held by a node tree, used for cache budgets.
+ * Shared children and textures are counted once per reference.
+ */
+gsize phi_node_device_estimate_size(GskRenderNode* node) {
+	// GskRenderNode instances themselves are roughly this large
+	gsize size = 64;
+	switch (gsk_render_node_get_node_type(node)) {
+		case GSK_CONTAINER_NODE:
+			for (guint i = 0; i < gsk_container_node_get_n_children(node); i++)
+				size += phi_node_device_estimate_size(gsk_container_node_get_child(node, i)) + sizeof(GskRenderNode*);
+			break;
+		case GSK_TRANSFORM_NODE:
+			size += phi_node_device_estimate_size(gsk_transform_node_get_child(node));
+			break;
+		case GSK_CLIP_NODE:
+			size += phi_node_device_estimate_size(gsk_clip_node_get_child(node));
+			break;
+		case GSK_ROUNDED_CLIP_NODE:
+			size += phi_node_device_estimate_size(gsk_rounded_clip_node_get_child(node));
+			break;
+		case GSK_OPACITY_NODE:
+			size += phi_node_device_estimate_size(gsk_opacity_node_get_child(node));
+			break;
+		case GSK_MASK_NODE:
+			size += phi_node_device_estimate_size(gsk_mask_node_get_source(node));
+			size += phi_node_device_estimate_size(gsk_mask_node_get_mask(node));
+			break;
+		case GSK_FILL_NODE:
+			size += phi_node_device_estimate_size(gsk_fill_node_get_child(node));
+			size += phi_node_device_estimate_path_size(gsk_fill_node_get_path(node));
+			break;
+		case GSK_STROKE_NODE:
+			size += phi_node_device_estimate_size(gsk_stroke_node_get_child(node));
+			size += phi_node_device_estimate_path_size(gsk_stroke_node_get_path(node));
+			break;
+		case GSK_TEXTURE_NODE: {
+			GdkTexture* texture = gsk_texture_node_get_texture(node);
+			size += (gsize)gdk_texture_get_width(texture) * gdk_texture_get_height(texture) * 4;
+		} break;
+		case GSK_TEXT_NODE:
+			size += gsk_text_node_get_num_glyphs(node) * sizeof(PangoGlyphInfo);
+			break;
+		default:
+			break;
+	}
+	return size;
 }
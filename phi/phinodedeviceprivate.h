@@ -22,8 +22,50 @@
 #include <gsk/gsk.h>
 #include <mupdf/fitz.h>
 
-fz_device* phi_node_device_new(fz_context* ctx);
+#include "phi/phifontcacheprivate.h"
+#include "phi/philrucacheprivate.h"
+
+// fills or strokes that are collected into one path at most
+#define PHI_NODE_DEVICE_MAX_BATCH 256
+// serialized paths shorter than this aren't worth a cache entry
+#define PHI_NODE_DEVICE_MIN_CACHED_PATH_SIZE 64
+// images are decoded with enough pixels to be zoomed in this far without getting blurry
+#define PHI_NODE_DEVICE_IMAGE_OVERSAMPLING 4.f
+// images larger than this, after reduction, are split into tiles of this size
+#define PHI_NODE_DEVICE_IMAGE_TILE_SIZE 2048
+// colors sampled from a shading function for a gradient node
+#define PHI_NODE_DEVICE_SHADE_SAMPLES 64
+
+typedef struct {
+	fz_image* image;
+	// the image is decoded at 1/2^level of its size
+	gint level;
+	// in pixels at full resolution
+	fz_irect area;
+	// holds a reference to image, so its address can't be reused while cached
+	GBytes* storage;
+} PhiNodeDeviceImageKey;
+
+guint phi_node_device_image_key_hash(const PhiNodeDeviceImageKey* key);
+gboolean phi_node_device_image_key_equal(const PhiNodeDeviceImageKey* a, const PhiNodeDeviceImageKey* b);
+void phi_node_device_image_key_free(PhiNodeDeviceImageKey* key);
+
+typedef struct {
+	PhiFontCache* fonts;
+	// PhiLruCache<GBytes, GskPath>, paths keyed by their serialized segments
+	PhiLruCache* paths;
+	// PhiLruCache<PhiNodeDeviceImageKey, GskRenderNode>, decoded images in pixel space
+	PhiLruCache* images;
+} PhiNodeDeviceCaches;
+
+fz_device* phi_node_device_new(fz_context* ctx, const PhiNodeDeviceCaches* caches);
+void phi_node_device_set_visible_area(fz_device* self, fz_rect area);
+void phi_node_device_decode_images(fz_context* ctx, fz_display_list* list, fz_rect visible, const PhiNodeDeviceCaches* caches, fz_cookie* cookie);
+// GFunc of the decode pool of PhiContext
+void phi_node_device_decode_job_run(gpointer job, gpointer);
 
 GskRenderNode* phi_node_device_pop_root(fz_device *self);
 
+gsize phi_node_device_estimate_size(GskRenderNode* node);
+
 #endif // __PHINODEDEVICEPRIVATE_H__
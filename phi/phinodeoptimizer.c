@@ -0,0 +1,443 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/phinodeoptimizerprivate.h"
+
+// paths with more points than this are kept as they are, so they can stay shared
+#define PHI_NODE_OPTIMIZER_MAX_FOLDED_POINTS 64
+// containers with more children than this are split into a bounding volume hierarchy
+#define PHI_NODE_OPTIMIZER_PARTITION_THRESHOLD 64
+#define PHI_NODE_OPTIMIZER_PARTITION_LEAF_SIZE 16
+
+typedef struct {
+	// GHashTable<GskRenderNode, GskRenderNode>, the optimized version of every visited node, or NULL if it draws nothing
+	GHashTable* memo;
+	// GHashSet<GskRenderNode>, containers making up a hierarchy, which must not be flattened again
+	GHashTable* partitions;
+} PhiNodeOptimizer;
+
+static GskRenderNode* phi_node_optimizer_visit(PhiNodeOptimizer* self, GskRenderNode* node);
+
+static void phi_node_optimizer_node_unref_nullable(GskRenderNode* node) {
+	if (node)
+		gsk_render_node_unref(node);
+}
+
+static gboolean phi_node_optimizer_count_points(GskPathOperation, const graphene_point_t*, gsize n_pts, float, gpointer user_data) {
+	gsize* count = user_data;
+	*count += n_pts;
+	return *count <= PHI_NODE_OPTIMIZER_MAX_FOLDED_POINTS;
+}
+
+typedef struct {
+	GskPathBuilder* builder;
+	GskTransform* transform;
+} PhiNodeOptimizerTransformPath;
+
+static gboolean phi_node_optimizer_transform_path_op(GskPathOperation op, const graphene_point_t* pts, gsize n_pts, float weight, gpointer user_data) {
+	PhiNodeOptimizerTransformPath* data = user_data;
+	graphene_point_t p[4];
+	for (gsize i = 0; i < n_pts && i < G_N_ELEMENTS(p); i++)
+		gsk_transform_transform_point(data->transform, &pts[i], &p[i]);
+
+	switch (op) {
+		case GSK_PATH_MOVE:
+			gsk_path_builder_move_to(data->builder, p[0].x, p[0].y);
+			break;
+		case GSK_PATH_CLOSE:
+			gsk_path_builder_close(data->builder);
+			break;
+		case GSK_PATH_LINE:
+			gsk_path_builder_line_to(data->builder, p[1].x, p[1].y);
+			break;
+		case GSK_PATH_QUAD:
+			gsk_path_builder_quad_to(data->builder, p[1].x, p[1].y, p[2].x, p[2].y);
+			break;
+		case GSK_PATH_CUBIC:
+			gsk_path_builder_cubic_to(data->builder, p[1].x, p[1].y, p[2].x, p[2].y, p[3].x, p[3].y);
+			break;
+		case GSK_PATH_CONIC:
+			gsk_path_builder_conic_to(data->builder, p[1].x, p[1].y, p[2].x, p[2].y, weight);
+			break;
+	}
+	return TRUE;
+}
+
+// Returns NULL if path is too large to be worth copying
+static GskPath* phi_node_optimizer_transform_path(GskPath* path, GskTransform* transform) {
+	const GskPathForeachFlags flags = GSK_PATH_FOREACH_ALLOW_QUAD | GSK_PATH_FOREACH_ALLOW_CUBIC | GSK_PATH_FOREACH_ALLOW_CONIC;
+	gsize n_points = 0;
+	if (!gsk_path_foreach(path, flags, phi_node_optimizer_count_points, &n_points))
+		return NULL;
+
+	PhiNodeOptimizerTransformPath data = {
+		.builder = gsk_path_builder_new(),
+		.transform = transform
+	};
+	gsk_path_foreach(path, flags, phi_node_optimizer_transform_path_op, &data);
+	return gsk_path_builder_free_to_path(data.builder);
+}
+
+/* Applies a scale and translate transform directly to the geometry of node.
+ * Returns NULL if that isn't possible or not worth it.
+ */
+static GskRenderNode* phi_node_optimizer_fold_transform(GskRenderNode* node, GskTransform* transform) {
+	GskTransformCategory category = gsk_transform_get_category(transform);
+	if (category < GSK_TRANSFORM_CATEGORY_2D_AFFINE)
+		return NULL;
+
+	switch (gsk_render_node_get_node_type(node)) {
+		case GSK_COLOR_NODE: {
+			graphene_rect_t bounds, transformed;
+			gsk_render_node_get_bounds(node, &bounds);
+			gsk_transform_transform_bounds(transform, &bounds, &transformed);
+			return gsk_color_node_new(gsk_color_node_get_color(node), &transformed);
+		}
+		case GSK_FILL_NODE: {
+			GskRenderNode* child = phi_node_optimizer_fold_transform(gsk_fill_node_get_child(node), transform);
+			if (!child)
+				return NULL;
+			GskPath* path = phi_node_optimizer_transform_path(gsk_fill_node_get_path(node), transform);
+			if (!path) {
+				gsk_render_node_unref(child);
+				return NULL;
+			}
+			GskRenderNode* ret = gsk_fill_node_new(child, path, gsk_fill_node_get_fill_rule(node));
+			gsk_render_node_unref(child);
+			gsk_path_unref(path);
+			return ret;
+		}
+		case GSK_STROKE_NODE: {
+			// a scale would have to be applied to the line width and dashes as well
+			if (category != GSK_TRANSFORM_CATEGORY_2D_TRANSLATE)
+				return NULL;
+			GskRenderNode* child = phi_node_optimizer_fold_transform(gsk_stroke_node_get_child(node), transform);
+			if (!child)
+				return NULL;
+			GskPath* path = phi_node_optimizer_transform_path(gsk_stroke_node_get_path(node), transform);
+			if (!path) {
+				gsk_render_node_unref(child);
+				return NULL;
+			}
+			GskRenderNode* ret = gsk_stroke_node_new(child, path, gsk_stroke_node_get_stroke(node));
+			gsk_render_node_unref(child);
+			gsk_path_unref(path);
+			return ret;
+		}
+		default:
+			return NULL;
+	}
+}
+
+// Takes ownership of child, which must already be optimized
+static GskRenderNode* phi_node_optimizer_clip(GskRenderNode* child, const graphene_rect_t* clip) {
+	graphene_rect_t bounds;
+	gsk_render_node_get_bounds(child, &bounds);
+	if (graphene_rect_contains_rect(clip, &bounds))
+		return child;
+
+	graphene_rect_t rect;
+	if (!graphene_rect_intersection(clip, &bounds, &rect)) {
+		gsk_render_node_unref(child);
+		return NULL;
+	}
+
+	GskRenderNode* ret;
+	if (gsk_render_node_get_node_type(child) == GSK_CLIP_NODE) {
+		// nested clips only ever shrink the visible area
+		graphene_rect_intersection(&rect, gsk_clip_node_get_clip(child), &rect);
+		ret = gsk_clip_node_new(gsk_clip_node_get_child(child), &rect);
+	} else {
+		ret = gsk_clip_node_new(child, clip);
+	}
+	gsk_render_node_unref(child);
+	return ret;
+}
+
+// Takes ownership of child, which must already be optimized
+static GskRenderNode* phi_node_optimizer_transform(GskRenderNode* child, GskTransform* transform) {
+	GskTransformCategory category = gsk_transform_get_category(transform);
+	if (category == GSK_TRANSFORM_CATEGORY_IDENTITY)
+		return child;
+
+	GskRenderNode* ret = phi_node_optimizer_fold_transform(child, transform);
+	if (ret) {
+		gsk_render_node_unref(child);
+		return ret;
+	}
+
+	switch (gsk_render_node_get_node_type(child)) {
+		case GSK_TRANSFORM_NODE: {
+			// applied from the inside out, so the inner transform goes last
+			GskTransform* combined = gsk_transform_transform(gsk_transform_ref(transform), gsk_transform_node_get_transform(child));
+			ret = phi_node_optimizer_transform(gsk_render_node_ref(gsk_transform_node_get_child(child)), combined);
+			gsk_transform_unref(combined);
+		} break;
+		case GSK_CLIP_NODE:
+			// moved below the transform, so it can be merged with clips further up
+			if (category >= GSK_TRANSFORM_CATEGORY_2D_AFFINE) {
+				graphene_rect_t clip;
+				gsk_transform_transform_bounds(transform, gsk_clip_node_get_clip(child), &clip);
+				GskRenderNode* transformed = phi_node_optimizer_transform(gsk_render_node_ref(gsk_clip_node_get_child(child)), transform);
+				ret = phi_node_optimizer_clip(transformed, &clip);
+				break;
+			}
+			G_GNUC_FALLTHROUGH;
+		default:
+			ret = gsk_transform_node_new(child, transform);
+			break;
+	}
+	gsk_render_node_unref(child);
+	return ret;
+}
+
+typedef struct {
+	GskRenderNode* node;
+	graphene_rect_t bounds;
+	guint index;
+} PhiNodeOptimizerItem;
+
+static gint phi_node_optimizer_item_compare_index(gconstpointer a, gconstpointer b, gpointer) {
+	const PhiNodeOptimizerItem* ia = a;
+	const PhiNodeOptimizerItem* ib = b;
+	return ia->index < ib->index ? -1 : ia->index > ib->index;
+}
+static gint phi_node_optimizer_item_compare_center(gconstpointer a, gconstpointer b, gpointer user_data) {
+	gboolean vertical = GPOINTER_TO_INT(user_data);
+	const graphene_rect_t* ra = &((const PhiNodeOptimizerItem*)a)->bounds;
+	const graphene_rect_t* rb = &((const PhiNodeOptimizerItem*)b)->bounds;
+	float ca = vertical ? ra->origin.y + ra->size.height / 2 : ra->origin.x + ra->size.width / 2;
+	float cb = vertical ? rb->origin.y + rb->size.height / 2 : rb->origin.x + rb->size.width / 2;
+	if (ca != cb)
+		return ca < cb ? -1 : 1;
+	return phi_node_optimizer_item_compare_index(a, b, NULL);
+}
+
+/* Sorts items along an axis and looks for the split closest to the middle
+ * where both halves don't overlap along it. As nothing on one side can
+ * paint over anything on the other, their relative order doesn't matter.
+ * Returns 0 if there is no such split.
+ */
+static guint phi_node_optimizer_spatial_split(PhiNodeOptimizerItem* items, guint n, gboolean vertical) {
+	g_qsort_with_data(items, n, sizeof(PhiNodeOptimizerItem), phi_node_optimizer_item_compare_center, GINT_TO_POINTER(vertical));
+
+	// suffix_start[i] is the lowest start of items[i..n)
+	float* suffix_start = g_new(float, n);
+	float start = G_MAXFLOAT;
+	for (guint i = n; i-- > 0;) {
+		const graphene_rect_t* r = &items[i].bounds;
+		start = MIN(start, vertical ? r->origin.y : r->origin.x);
+		suffix_start[i] = start;
+	}
+
+	guint split = 0;
+	float end = -G_MAXFLOAT;
+	for (guint i = 1; i < n; i++) {
+		const graphene_rect_t* r = &items[i - 1].bounds;
+		end = MAX(end, vertical ? r->origin.y + r->size.height : r->origin.x + r->size.width);
+		// strict, anti-aliased edges of items that merely touch still blend into each other
+		if (end < suffix_start[i] && (split == 0 || ABS((gint)i - (gint)n / 2) < ABS((gint)split - (gint)n / 2)))
+			split = i;
+	}
+	g_free(suffix_start);
+	return split;
+}
+
+// items are in paint order and get reordered in place
+static GskRenderNode* phi_node_optimizer_partition(PhiNodeOptimizer* self, PhiNodeOptimizerItem* items, guint n) {
+	GskRenderNode* ret;
+	if (n == 1)
+		return gsk_render_node_ref(items[0].node);
+	if (n <= PHI_NODE_OPTIMIZER_PARTITION_LEAF_SIZE) {
+		GskRenderNode* children[PHI_NODE_OPTIMIZER_PARTITION_LEAF_SIZE];
+		for (guint i = 0; i < n; i++)
+			children[i] = items[i].node;
+		ret = gsk_container_node_new(children, n);
+		g_hash_table_add(self->partitions, gsk_render_node_ref(ret));
+		return ret;
+	}
+
+	graphene_rect_t bounds = items[0].bounds;
+	for (guint i = 1; i < n; i++)
+		graphene_rect_union(&bounds, &items[i].bounds, &bounds);
+
+	// try the longer axis first, and fall back to splitting in paint order, which is always correct
+	gboolean vertical = bounds.size.height > bounds.size.width;
+	guint split = phi_node_optimizer_spatial_split(items, n, vertical);
+	if (split == 0)
+		split = phi_node_optimizer_spatial_split(items, n, !vertical);
+	if (split != 0) {
+		g_qsort_with_data(items, split, sizeof(PhiNodeOptimizerItem), phi_node_optimizer_item_compare_index, NULL);
+		g_qsort_with_data(items + split, n - split, sizeof(PhiNodeOptimizerItem), phi_node_optimizer_item_compare_index, NULL);
+	} else {
+		g_qsort_with_data(items, n, sizeof(PhiNodeOptimizerItem), phi_node_optimizer_item_compare_index, NULL);
+		split = n / 2;
+	}
+
+	GskRenderNode* halves[2] = {
+		phi_node_optimizer_partition(self, items, split),
+		phi_node_optimizer_partition(self, items + split, n - split)
+	};
+	ret = gsk_container_node_new(halves, 2);
+	gsk_render_node_unref(halves[0]);
+	gsk_render_node_unref(halves[1]);
+	g_hash_table_add(self->partitions, gsk_render_node_ref(ret));
+	return ret;
+}
+
+static GskRenderNode* phi_node_optimizer_container(PhiNodeOptimizer* self, GskRenderNode* node) {
+	guint n_children = gsk_container_node_get_n_children(node);
+	GPtrArray* children = g_ptr_array_new_full(n_children, (GDestroyNotify)gsk_render_node_unref);
+	gboolean changed = FALSE;
+	for (guint i = 0; i < n_children; i++) {
+		GskRenderNode* child = gsk_container_node_get_child(node, i);
+		GskRenderNode* optimized = phi_node_optimizer_visit(self, child);
+		if (optimized != child)
+			changed = TRUE;
+		if (!optimized)
+			continue;
+
+		// containers don't have any semantics of their own, so nested ones can be spliced in
+		if (gsk_render_node_get_node_type(optimized) == GSK_CONTAINER_NODE && !g_hash_table_contains(self->partitions, optimized)) {
+			for (guint j = 0; j < gsk_container_node_get_n_children(optimized); j++)
+				g_ptr_array_add(children, gsk_render_node_ref(gsk_container_node_get_child(optimized, j)));
+			gsk_render_node_unref(optimized);
+			changed = TRUE;
+		} else {
+			g_ptr_array_add(children, optimized);
+		}
+	}
+
+	GskRenderNode* ret;
+	if (children->len == 0)
+		ret = NULL;
+	else if (children->len == 1)
+		ret = gsk_render_node_ref(g_ptr_array_index(children, 0));
+	else if (children->len > PHI_NODE_OPTIMIZER_PARTITION_THRESHOLD) {
+		/* GSK culls the children of a container one by one, which gets slow
+		 * for huge pages viewed zoomed in. Nesting them by location allows
+		 * skipping whole subtrees instead.
+		 */
+		PhiNodeOptimizerItem* items = g_new(PhiNodeOptimizerItem, children->len);
+		for (guint i = 0; i < children->len; i++) {
+			items[i].node = g_ptr_array_index(children, i);
+			gsk_render_node_get_bounds(items[i].node, &items[i].bounds);
+			items[i].index = i;
+		}
+		ret = phi_node_optimizer_partition(self, items, children->len);
+		g_free(items);
+	} else if (!changed)
+		ret = gsk_render_node_ref(node);
+	else
+		ret = gsk_container_node_new((GskRenderNode**)children->pdata, children->len);
+	g_ptr_array_unref(children);
+	return ret;
+}
+
+static GskRenderNode* phi_node_optimizer_optimize(PhiNodeOptimizer* self, GskRenderNode* node) {
+	switch (gsk_render_node_get_node_type(node)) {
+		case GSK_CONTAINER_NODE:
+			return phi_node_optimizer_container(self, node);
+		case GSK_TRANSFORM_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_transform_node_get_child(node));
+			if (!child)
+				return NULL;
+			return phi_node_optimizer_transform(child, gsk_transform_node_get_transform(node));
+		}
+		case GSK_CLIP_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_clip_node_get_child(node));
+			if (!child)
+				return NULL;
+			return phi_node_optimizer_clip(child, gsk_clip_node_get_clip(node));
+		}
+		case GSK_ROUNDED_CLIP_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_rounded_clip_node_get_child(node));
+			if (!child)
+				return NULL;
+			GskRenderNode* ret = child == gsk_rounded_clip_node_get_child(node) ? gsk_render_node_ref(node) : gsk_rounded_clip_node_new(child, gsk_rounded_clip_node_get_clip(node));
+			gsk_render_node_unref(child);
+			return ret;
+		}
+		case GSK_OPACITY_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_opacity_node_get_child(node));
+			if (!child)
+				return NULL;
+			float opacity = gsk_opacity_node_get_opacity(node);
+			if (opacity >= 1.f)
+				return child;
+			GskRenderNode* ret = child == gsk_opacity_node_get_child(node) ? gsk_render_node_ref(node) : gsk_opacity_node_new(child, opacity);
+			gsk_render_node_unref(child);
+			return ret;
+		}
+		case GSK_MASK_NODE: {
+			GskRenderNode* source = phi_node_optimizer_visit(self, gsk_mask_node_get_source(node));
+			GskRenderNode* mask = phi_node_optimizer_visit(self, gsk_mask_node_get_mask(node));
+			GskRenderNode* ret;
+			if (!source || !mask)
+				ret = NULL;
+			else if (source == gsk_mask_node_get_source(node) && mask == gsk_mask_node_get_mask(node))
+				ret = gsk_render_node_ref(node);
+			else
+				ret = gsk_mask_node_new(source, mask, gsk_mask_node_get_mask_mode(node));
+			phi_node_optimizer_node_unref_nullable(source);
+			phi_node_optimizer_node_unref_nullable(mask);
+			return ret;
+		}
+		case GSK_FILL_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_fill_node_get_child(node));
+			if (!child)
+				return NULL;
+			GskRenderNode* ret = child == gsk_fill_node_get_child(node) ? gsk_render_node_ref(node) : gsk_fill_node_new(child, gsk_fill_node_get_path(node), gsk_fill_node_get_fill_rule(node));
+			gsk_render_node_unref(child);
+			return ret;
+		}
+		case GSK_STROKE_NODE: {
+			GskRenderNode* child = phi_node_optimizer_visit(self, gsk_stroke_node_get_child(node));
+			if (!child)
+				return NULL;
+			GskRenderNode* ret = child == gsk_stroke_node_get_child(node) ? gsk_render_node_ref(node) : gsk_stroke_node_new(child, gsk_stroke_node_get_path(node), gsk_stroke_node_get_stroke(node));
+			gsk_render_node_unref(child);
+			return ret;
+		}
+		default:
+			return gsk_render_node_ref(node);
+	}
+}
+
+static GskRenderNode* phi_node_optimizer_visit(PhiNodeOptimizer* self, GskRenderNode* node) {
+	GskRenderNode* ret;
+	if (g_hash_table_lookup_extended(self->memo, node, NULL, (gpointer*)&ret))
+		return ret ? gsk_render_node_ref(ret) : NULL;
+
+	ret = phi_node_optimizer_optimize(self, node);
+	g_hash_table_insert(self->memo, node, ret ? gsk_render_node_ref(ret) : NULL);
+	return ret;
+}
+
+GskRenderNode* phi_node_optimize(GskRenderNode* node) {
+	PhiNodeOptimizer self = {
+		.memo = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)phi_node_optimizer_node_unref_nullable),
+		.partitions = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)gsk_render_node_unref, NULL)
+	};
+	GskRenderNode* ret = phi_node_optimizer_visit(&self, node);
+	g_hash_table_unref(self.memo);
+	g_hash_table_unref(self.partitions);
+	if (!ret)
+		ret = gsk_container_node_new(NULL, 0);
+	return ret;
+}
@@ -23,13 +23,26 @@
 
 G_DEFINE_FINAL_TYPE(PhiPage, phi_page, G_TYPE_OBJECT)
 
-static void phi_page_object_dispose(GObject* object) {
-	PhiPage* self = PHI_PAGE(object);
+// releases everything that needs the document, which disposes its pages before going away
+void phi_page_detach(PhiPage* self) {
+	if (!self->document)
+		return;
+	if (self->list) {
+		fz_drop_display_list(self->document->ctx, self->list);
+		self->list = NULL;
+	}
 	if (self->page) {
+		g_mutex_lock(&self->document->lock);
 		fz_drop_page(self->document->ctx, self->page);
+		g_mutex_unlock(&self->document->lock);
 		self->page = NULL;
 	}
 	g_clear_weak_pointer(&self->document);
+}
+
+static void phi_page_object_dispose(GObject* object) {
+	PhiPage* self = PHI_PAGE(object);
+	phi_page_detach(self);
 	G_OBJECT_CLASS(phi_page_parent_class)->dispose(object);
 }
 
@@ -40,30 +53,307 @@ static void phi_page_class_init(PhiPageClass* klass) {
 
 static void phi_page_init(PhiPage* self) {
 	self->document = NULL;
+	self->index = -1;
 	self->page = NULL;
+	self->list = NULL;
 }
 
-GskRenderNode* phi_page_render_to_node(PhiPage* self, GError** error) {
-	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
-	
+fz_display_list* phi_page_get_display_list(PhiPage* self, fz_context* ctx, fz_cookie* cookie) {
+	fz_display_list* list = NULL;
 	fz_device* device = NULL;
-	GskRenderNode* ret = NULL;
+	g_mutex_lock(&self->document->lock);
+	fz_var(list);
+	fz_var(device);
+	fz_try(ctx) {
+		if (!self->list) {
+			list = fz_new_display_list(ctx, fz_bound_page(ctx, self->page));
+			device = fz_new_list_device(ctx, list);
+			fz_run_page(ctx, self->page, device, fz_identity, cookie);
+			fz_close_device(ctx, device);
+			// an interrupted recording is incomplete and must not be replayed later
+			if (cookie && cookie->abort)
+				fz_throw(ctx, FZ_ERROR_ABORT, "Recording of page aborted");
+			self->list = list;
+		} else {
+			list = self->list;
+		}
+		list = fz_keep_display_list(ctx, list);
+	} fz_always(ctx) {
+		g_mutex_unlock(&self->document->lock);
+		fz_drop_device(ctx, device);
+	} fz_catch(ctx) {
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	return list;
+}
+
+void phi_page_get_bounds(PhiPage* self, graphene_rect_t* bounds) {
+	g_return_if_fail(PHI_IS_PAGE(self));
+	g_return_if_fail(bounds != NULL);
+
+	// fz_empty_rect is inverted, it would turn into a huge negative size
+	fz_rect rect = fz_make_rect(0, 0, 0, 0);
+	if (!self->document) {
+		graphene_rect_init(bounds, 0.f, 0.f, 0.f, 0.f);
+		return;
+	}
+	g_mutex_lock(&self->document->lock);
 	fz_try(self->document->ctx) {
-		device = phi_node_device_new(self->document->ctx);
-		fz_run_page(self->document->ctx, self->page, device, fz_identity, NULL);
-		ret = phi_node_device_pop_root(device);
+		rect = fz_bound_page(self->document->ctx, self->page);
 	} fz_always(self->document->ctx) {
-		if (device)
-			fz_drop_device(self->document->ctx, device);
+		g_mutex_unlock(&self->document->lock);
 	} fz_catch(self->document->ctx) {
+		g_warning("Failed to bound page: %s", fz_caught_message(self->document->ctx));
+	}
+	graphene_rect_init(bounds, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+}
+
+GskRenderNode* phi_page_render_to_node_with_context(PhiPage* self, fz_context* ctx, const graphene_rect_t* region, fz_cookie* cookie, GError** error) {
+	// the display list skips everything outside of the scissor without interpreting it
+	fz_rect scissor = fz_infinite_rect;
+	if (region)
+		scissor = fz_make_rect(region->origin.x, region->origin.y, region->origin.x + region->size.width, region->origin.y + region->size.height);
+
+	fz_display_list* list = NULL;
+	fz_device* device = NULL;
+	GskRenderNode* ret = NULL;
+	fz_try(ctx) {
+		list = phi_page_get_display_list(self, ctx, cookie);
+		phi_node_device_decode_images(ctx, list, scissor, &self->document->caches, cookie);
+		// replaying doesn't touch the document, so this may run concurrently
+		device = phi_node_device_new(ctx, &self->document->caches);
+		phi_node_device_set_visible_area(device, scissor);
+		fz_run_display_list(ctx, list, device, fz_identity, scissor, cookie);
+		ret = phi_node_device_pop_root(device);
+	} fz_always(ctx) {
+		if (device)
+			fz_drop_device(ctx, device);
+		fz_drop_display_list(ctx, list);
+	} fz_catch(ctx) {
 		if (ret)
 			gsk_render_node_unref(ret);
-		g_set_error_literal(error, PHI_MU_ERROR, fz_caught(self->document->ctx), fz_caught_message(self->document->ctx));
+		g_set_error_literal(error, PHI_MU_ERROR, fz_caught(ctx), fz_caught_message(ctx));
 		return NULL;
 	}
 	return ret;
 }
 
+GskRenderNode* phi_page_render_to_node(PhiPage* self, GError** error) {
+	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
+	g_return_val_if_fail(self->document != NULL, NULL);
+
+	GskRenderNode* ret = phi_document_lookup_node(self->document, self->index);
+	if (ret)
+		return ret;
+
+	ret = phi_page_render_to_node_with_context(self, self->document->ctx, NULL, NULL, error);
+	if (ret)
+		phi_document_cache_node(self->document, self->index, ret);
+	return ret;
+}
+
+/* Only converts the content intersecting region, which is in page space.
+ * Content that is partially visible is included entirely. Meant for
+ * huge pages viewed zoomed in, so the result is neither cached nor taken
+ * from the cache of whole pages.
+ */
+GskRenderNode* phi_page_render_region_to_node(PhiPage* self, const graphene_rect_t* region, GError** error) {
+	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
+	g_return_val_if_fail(self->document != NULL, NULL);
+	g_return_val_if_fail(region != NULL, NULL);
+
+	return phi_page_render_to_node_with_context(self, self->document->ctx, region, NULL, error);
+}
+
+typedef struct {
+	PhiDocument* document; // strong, keeps the base context alive
+	fz_cookie cookie;
+	GCancellable* cancellable;
+	gulong cancelled_id;
+	gboolean cached;
+	gboolean has_region;
+	graphene_rect_t region;
+	gdouble scale; // of rasterizations
+} PhiPageRenderData;
+
+static void phi_page_render_data_free(PhiPageRenderData* self) {
+	if (self->cancelled_id)
+		g_cancellable_disconnect(self->cancellable, self->cancelled_id);
+	g_clear_object(&self->cancellable);
+	g_object_unref(self->document);
+	g_free(self);
+}
+
+static void phi_page_render_cancelled(GCancellable*, PhiPageRenderData* data) {
+	// polled by the interpreter, so this aborts a running fz_run_page
+	data->cookie.abort = 1;
+}
+
+static void phi_page_render_to_node_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable*) {
+	PhiPage* self = PHI_PAGE(source_object);
+	PhiPageRenderData* data = task_data;
+
+	fz_context* ctx = fz_clone_context(data->document->ctx);
+	if (!ctx) {
+		g_task_return_new_error(task, PHI_MU_ERROR, FZ_ERROR_SYSTEM, "Failed to clone context");
+		return;
+	}
+
+	GError* error = NULL;
+	GskRenderNode* node = phi_page_render_to_node_with_context(self, ctx, data->has_region ? &data->region : NULL, &data->cookie, &error);
+	fz_drop_context(ctx);
+
+	if (g_task_return_error_if_cancelled(task)) {
+		if (node)
+			gsk_render_node_unref(node);
+		g_clear_error(&error);
+		return;
+	}
+	if (!node) {
+		g_task_return_error(task, error);
+		return;
+	}
+	g_task_return_pointer(task, node, (GDestroyNotify)gsk_render_node_unref);
+}
+
+static void phi_page_render_async(PhiPage* self, const graphene_rect_t* region, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data, gpointer source_tag) {
+	GTask* task = g_task_new(self, cancellable, callback, user_data);
+	g_task_set_source_tag(task, source_tag);
+
+	PhiPageRenderData* data = g_new0(PhiPageRenderData, 1);
+	data->document = g_object_ref(self->document);
+	if (region) {
+		data->has_region = TRUE;
+		data->region = *region;
+	}
+	g_task_set_task_data(task, data, (GDestroyNotify)phi_page_render_data_free);
+
+	// regions are always converted on their own, returning the whole page would defeat them
+	GskRenderNode* node = region ? NULL : phi_document_lookup_node(self->document, self->index);
+	if (node) {
+		data->cached = TRUE;
+		g_task_return_pointer(task, node, (GDestroyNotify)gsk_render_node_unref);
+		g_object_unref(task);
+		return;
+	}
+
+	if (cancellable) {
+		data->cancellable = g_object_ref(cancellable);
+		data->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(phi_page_render_cancelled), data, NULL);
+	}
+
+	g_task_run_in_thread(task, phi_page_render_to_node_thread);
+	g_object_unref(task);
+}
+
+void phi_page_render_to_node_async(PhiPage* self, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	g_return_if_fail(PHI_IS_PAGE(self));
+	g_return_if_fail(self->document != NULL);
+	phi_page_render_async(self, NULL, cancellable, callback, user_data, phi_page_render_to_node_async);
+}
+
+GskRenderNode* phi_page_render_to_node_finish(PhiPage* self, GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
+	g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+	g_return_val_if_fail(g_task_get_source_tag(G_TASK(result)) == phi_page_render_to_node_async, NULL);
+
+	GskRenderNode* ret = g_task_propagate_pointer(G_TASK(result), error);
+	PhiPageRenderData* data = g_task_get_task_data(G_TASK(result));
+	// inserted here, so evictions are signalled on the callers thread
+	if (ret && !data->cached && self->document)
+		phi_document_cache_node(self->document, self->index, ret);
+	return ret;
+}
+
+void phi_page_render_region_to_node_async(PhiPage* self, const graphene_rect_t* region, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	g_return_if_fail(PHI_IS_PAGE(self));
+	g_return_if_fail(self->document != NULL);
+	g_return_if_fail(region != NULL);
+	phi_page_render_async(self, region, cancellable, callback, user_data, phi_page_render_region_to_node_async);
+}
+
+GskRenderNode* phi_page_render_region_to_node_finish(PhiPage* self, GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
+	g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+	g_return_val_if_fail(g_task_get_source_tag(G_TASK(result)) == phi_page_render_region_to_node_async, NULL);
+
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static void phi_page_rasterize_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable*) {
+	PhiPage* self = PHI_PAGE(source_object);
+	PhiPageRenderData* data = task_data;
+
+	fz_context* ctx = fz_clone_context(data->document->ctx);
+	if (!ctx) {
+		g_task_return_new_error(task, PHI_MU_ERROR, FZ_ERROR_SYSTEM, "Failed to clone context");
+		return;
+	}
+
+	GError* error = NULL;
+	fz_display_list* list = NULL;
+	fz_pixmap* pixmap = NULL;
+	GdkTexture* texture = NULL;
+	fz_var(list);
+	fz_var(pixmap);
+	fz_try(ctx) {
+		list = phi_page_get_display_list(self, ctx, &data->cookie);
+		// the draw device is run directly, no node tree is built for this
+		pixmap = fz_new_pixmap_from_display_list(ctx, list, fz_scale(data->scale, data->scale), fz_device_rgb(ctx), 1);
+		GBytes* bytes = g_bytes_new(fz_pixmap_samples(ctx, pixmap), fz_pixmap_size(ctx, pixmap));
+		texture = gdk_memory_texture_new(fz_pixmap_width(ctx, pixmap), fz_pixmap_height(ctx, pixmap), GDK_MEMORY_R8G8B8A8_PREMULTIPLIED, bytes, fz_pixmap_stride(ctx, pixmap));
+		g_bytes_unref(bytes);
+	} fz_always(ctx) {
+		fz_drop_pixmap(ctx, pixmap);
+		fz_drop_display_list(ctx, list);
+	} fz_catch(ctx) {
+		g_set_error_literal(&error, PHI_MU_ERROR, fz_caught(ctx), fz_caught_message(ctx));
+	}
+	fz_drop_context(ctx);
+
+	if (g_task_return_error_if_cancelled(task)) {
+		g_clear_object(&texture);
+		g_clear_error(&error);
+		return;
+	}
+	if (!texture) {
+		g_task_return_error(task, error);
+		return;
+	}
+	g_task_return_pointer(task, texture, g_object_unref);
+}
+
+void phi_page_rasterize_async(PhiPage* self, gdouble scale, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+	g_return_if_fail(PHI_IS_PAGE(self));
+	g_return_if_fail(self->document != NULL);
+	g_return_if_fail(scale > 0.);
+
+	GTask* task = g_task_new(self, cancellable, callback, user_data);
+	g_task_set_source_tag(task, phi_page_rasterize_async);
+
+	PhiPageRenderData* data = g_new0(PhiPageRenderData, 1);
+	data->document = g_object_ref(self->document);
+	data->scale = scale;
+	g_task_set_task_data(task, data, (GDestroyNotify)phi_page_render_data_free);
+
+	if (cancellable) {
+		data->cancellable = g_object_ref(cancellable);
+		data->cancelled_id = g_cancellable_connect(cancellable, G_CALLBACK(phi_page_render_cancelled), data, NULL);
+	}
+
+	g_task_run_in_thread(task, phi_page_rasterize_thread);
+	g_object_unref(task);
+}
+
+GdkTexture* phi_page_rasterize_finish(PhiPage* self, GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
+	g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+	g_return_val_if_fail(g_task_get_source_tag(G_TASK(result)) == phi_page_rasterize_async, NULL);
+
+	return g_task_propagate_pointer(G_TASK(result), error);
+}
+
 GdkPaintable* phi_page_render_to_paintable(PhiPage* self, GError** error) {
 	g_return_val_if_fail(PHI_IS_PAGE(self), NULL);
 	
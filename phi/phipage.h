@@ -28,7 +28,14 @@ G_BEGIN_DECLS
 #define PHI_TYPE_PAGE (phi_page_get_type())
 G_DECLARE_FINAL_TYPE(PhiPage, phi_page, PHI, PAGE, GObject)
 
+void phi_page_get_bounds(PhiPage* self, graphene_rect_t* bounds);
+
 GskRenderNode* phi_page_render_to_node(PhiPage* self, GError** error);
+void phi_page_render_to_node_async(PhiPage* self, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GskRenderNode* phi_page_render_to_node_finish(PhiPage* self, GAsyncResult* result, GError** error);
+GskRenderNode* phi_page_render_region_to_node(PhiPage* self, const graphene_rect_t* region, GError** error);
+void phi_page_render_region_to_node_async(PhiPage* self, const graphene_rect_t* region, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GskRenderNode* phi_page_render_region_to_node_finish(PhiPage* self, GAsyncResult* result, GError** error);
 GdkPaintable* phi_page_render_to_paintable(PhiPage* self, GError** error);
 
 G_END_DECLS
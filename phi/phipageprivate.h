@@ -30,10 +30,21 @@ G_BEGIN_DECLS
 struct _PhiPage {
 	GObject parent_instance;
 	
-	PhiDocument* document; // weak
+	PhiDocument* document; // weak, unset once the document is disposed
+	gint index;
 	fz_page* page;
+	// recorded lazily, guarded by the documents lock
+	fz_display_list* list;
 };
 
+void phi_page_detach(PhiPage* self);
+fz_display_list* phi_page_get_display_list(PhiPage* self, fz_context* ctx, fz_cookie* cookie);
+// region is in page space, or NULL for the whole page
+GskRenderNode* phi_page_render_to_node_with_context(PhiPage* self, fz_context* ctx, const graphene_rect_t* region, fz_cookie* cookie, GError** error);
+// draws the whole page with MuPDF at scale pixels per point, bypassing the node cache
+void phi_page_rasterize_async(PhiPage* self, gdouble scale, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+GdkTexture* phi_page_rasterize_finish(PhiPage* self, GAsyncResult* result, GError** error);
+
 G_END_DECLS
 
 #endif // __PHIPAGEPRIVATE_H__
@@ -0,0 +1,129 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "phi/phipixelconvertprivate.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define PHI_PIXEL_CONVERT_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PHI_PIXEL_CONVERT_NEON
+#endif
+
+// r = 1 - min(c + k, 1), the same for green and blue
+static inline void phi_pixel_convert_cmyk_to_rgbx_scalar(const guint8* src, guint8* dst, gsize n) {
+	for (gsize i = 0; i < n; i++, src += 4, dst += 4) {
+		guint k = src[3];
+		dst[0] = 255 - MIN(src[0] + k, 255u);
+		dst[1] = 255 - MIN(src[1] + k, 255u);
+		dst[2] = 255 - MIN(src[2] + k, 255u);
+		dst[3] = 255;
+	}
+}
+
+#ifdef PHI_PIXEL_CONVERT_X86
+// k of every pixel broadcast into all of its bytes, then a saturating add does min(c + k, 255)
+static inline __m128i phi_pixel_convert_cmyk_to_rgbx_sse2_px(__m128i px) {
+	__m128i k = _mm_srli_epi32(px, 24);
+	k = _mm_or_si128(k, _mm_slli_epi32(k, 8));
+	k = _mm_or_si128(k, _mm_slli_epi32(k, 16));
+	__m128i rgb = _mm_xor_si128(_mm_adds_epu8(px, k), _mm_set1_epi32(-1));
+	return _mm_or_si128(rgb, _mm_set1_epi32((gint32)0xff000000));
+}
+static gsize phi_pixel_convert_cmyk_to_rgbx_sse2(const guint8* src, guint8* dst, gsize n) {
+	gsize i = 0;
+	for (; i + 4 <= n; i += 4, src += 16, dst += 16)
+		_mm_storeu_si128((__m128i*)dst, phi_pixel_convert_cmyk_to_rgbx_sse2_px(_mm_loadu_si128((const __m128i*)src)));
+	return i;
+}
+
+#if defined(__GNUC__)
+#define PHI_PIXEL_CONVERT_AVX2
+__attribute__((target("avx2")))
+static gsize phi_pixel_convert_cmyk_to_rgbx_avx2(const guint8* src, guint8* dst, gsize n) {
+	gsize i = 0;
+	for (; i + 8 <= n; i += 8, src += 32, dst += 32) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)src);
+		__m256i k = _mm256_srli_epi32(px, 24);
+		k = _mm256_or_si256(k, _mm256_slli_epi32(k, 8));
+		k = _mm256_or_si256(k, _mm256_slli_epi32(k, 16));
+		__m256i rgb = _mm256_xor_si256(_mm256_adds_epu8(px, k), _mm256_set1_epi32(-1));
+		_mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(rgb, _mm256_set1_epi32((gint32)0xff000000)));
+	}
+	return i;
+}
+#endif
+#endif
+
+#ifdef PHI_PIXEL_CONVERT_NEON
+static gsize phi_pixel_convert_cmyk_to_rgbx_neon(const guint8* src, guint8* dst, gsize n) {
+	gsize i = 0;
+	for (; i + 16 <= n; i += 16, src += 64, dst += 64) {
+		uint8x16x4_t px = vld4q_u8(src);
+		px.val[0] = vmvnq_u8(vqaddq_u8(px.val[0], px.val[3]));
+		px.val[1] = vmvnq_u8(vqaddq_u8(px.val[1], px.val[3]));
+		px.val[2] = vmvnq_u8(vqaddq_u8(px.val[2], px.val[3]));
+		px.val[3] = vdupq_n_u8(255);
+		vst4q_u8(dst, px);
+	}
+	return i;
+}
+#endif
+
+typedef gsize (*PhiPixelConvertKernel)(const guint8* src, guint8* dst, gsize n);
+
+static PhiPixelConvertKernel phi_pixel_convert_cmyk_to_rgbx_kernel(void) {
+#if defined(PHI_PIXEL_CONVERT_AVX2)
+	if (__builtin_cpu_supports("avx2"))
+		return phi_pixel_convert_cmyk_to_rgbx_avx2;
+#endif
+#if defined(PHI_PIXEL_CONVERT_X86)
+	return phi_pixel_convert_cmyk_to_rgbx_sse2;
+#elif defined(PHI_PIXEL_CONVERT_NEON)
+	return phi_pixel_convert_cmyk_to_rgbx_neon;
+#else
+	return NULL;
+#endif
+}
+
+void phi_pixel_convert_cmyk_to_rgbx(const guint8* src, gsize src_stride, guint8* dst, gsize dst_stride, gsize width, gsize height) {
+	PhiPixelConvertKernel kernel = phi_pixel_convert_cmyk_to_rgbx_kernel();
+	for (gsize y = 0; y < height; y++) {
+		const guint8* src_row = src + y * src_stride;
+		guint8* dst_row = dst + y * dst_stride;
+		gsize done = kernel ? kernel(src_row, dst_row, width) : 0;
+		phi_pixel_convert_cmyk_to_rgbx_scalar(src_row + done * 4, dst_row + done * 4, width - done);
+	}
+}
+
+// with premultiplied alpha r = a * (1 - min(c/a + k/a, 1)) = a - min(c + k, a)
+void phi_pixel_convert_cmyka_to_rgba(const guint8* src, gsize src_stride, guint8* dst, gsize dst_stride, gsize width, gsize height) {
+	for (gsize y = 0; y < height; y++) {
+		const guint8* s = src + y * src_stride;
+		guint8* d = dst + y * dst_stride;
+		for (gsize i = 0; i < width; i++, s += 5, d += 4) {
+			guint k = s[3];
+			guint a = s[4];
+			d[0] = a - MIN(s[0] + k, a);
+			d[1] = a - MIN(s[1] + k, a);
+			d[2] = a - MIN(s[2] + k, a);
+			d[3] = a;
+		}
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * libphi - High performance document renderer for GTK
+ * Copyright (C) 2025  Florian "sp1rit" <sp1rit@disoot.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PHIPIXELCONVERTPRIVATE_H__
+#define __PHIPIXELCONVERTPRIVATE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Conversions of pixmap layouts GDK can't take as they are, using the
+ * same formula as MuPDF without color management.
+ */
+
+// CMYK to RGBX, 4 bytes per pixel either way
+void phi_pixel_convert_cmyk_to_rgbx(const guint8* src, gsize src_stride, guint8* dst, gsize dst_stride, gsize width, gsize height);
+// premultiplied CMYK with alpha to premultiplied RGBA, scalar only: 5 byte pixels don't split into vector lanes
+void phi_pixel_convert_cmyka_to_rgba(const guint8* src, gsize src_stride, guint8* dst, gsize dst_stride, gsize width, gsize height);
+
+G_END_DECLS
+
+#endif // __PHIPIXELCONVERTPRIVATE_H__
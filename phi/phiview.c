@@ -20,14 +20,54 @@
 
 #include <math.h>
 
+#include "phi/phipageprivate.h"
+
+// edge length of a high resolution tile, in device pixels
+#define PHI_VIEW_TILE_SIZE 256
+// zoom levels are quantized into buckets, tiles are only reused within a bucket
+#define PHI_VIEW_ZOOM_BUCKETS_PER_OCTAVE 4
+// upper bound of cached tiles before off-screen ones get dropped
+#define PHI_VIEW_MAX_TILES 256
+
+typedef struct {
+	gint zoom;
+	gint x, y;
+} PhiViewTileKey;
+
+static guint phi_view_tile_key_hash(const PhiViewTileKey* key) {
+	guint hash = (guint)key->zoom;
+	hash = hash * 31 + (guint)key->x;
+	hash = hash * 31 + (guint)key->y;
+	return hash;
+}
+static gboolean phi_view_tile_key_equal(const PhiViewTileKey* a, const PhiViewTileKey* b) {
+	return a->zoom == b->zoom && a->x == b->x && a->y == b->y;
+}
+
+static gint phi_view_zoom_bucket(gdouble scale) {
+	// round up, so tiles are always downsampled when drawn
+	return (gint)ceil(log2(scale) * PHI_VIEW_ZOOM_BUCKETS_PER_OCTAVE - 1e-6);
+}
+static gdouble phi_view_zoom_bucket_scale(gint zoom) {
+	return exp2((gdouble)zoom / PHI_VIEW_ZOOM_BUCKETS_PER_OCTAVE);
+}
+
 struct _PhiView {
 	GtkWidget parent_instance;
 
 	GskRenderer* renderer;
+	GMemoryMonitor* memory_monitor;
 
 	GskRenderNode* node;
+	// alternatively to node, only the visible regions of a page are converted
+	PhiPage* page;
+	graphene_rect_t page_bounds;
+	// pending conversions of page, cancelled when they are superseded
+	GCancellable* overview_cancellable;
+	GCancellable* tiles_cancellable;
 	GskRenderNode* cached_low_res;
-	GskRenderNode* cached_high_res;
+	// GHashTable<PhiViewTileKey, GskRenderNode>, clipped texture nodes in node coordinates
+	GHashTable* high_res_tiles;
 	guint generate_cache_source;
 
 	guint high_res_timeout;
@@ -50,17 +90,34 @@ G_DEFINE_FINAL_TYPE (PhiView, phi_view, GTK_TYPE_WIDGET)
 
 enum {
 	PROP_NODE = 1,
+	PROP_PAGE,
 	PROP_HIGH_RES_TIMEOUT,
 	PROP_INVERTED,
 	N_PROPERTIES
 };
 static GParamSpec* obj_properties[N_PROPERTIES] = { 0, };
 
+// the callbacks of cancelled conversions don't touch the view anymore
+static void phi_view_cancel_conversions(PhiView* self) {
+	if (self->overview_cancellable) {
+		g_cancellable_cancel(self->overview_cancellable);
+		g_clear_object(&self->overview_cancellable);
+	}
+	if (self->tiles_cancellable) {
+		g_cancellable_cancel(self->tiles_cancellable);
+		g_clear_object(&self->tiles_cancellable);
+	}
+}
+
 static void phi_view_object_dispose(GObject* object) {
 	PhiView* self = PHI_VIEW(object);
 	g_clear_pointer(&self->node, gsk_render_node_unref);
+	g_clear_object(&self->page);
+	phi_view_cancel_conversions(self);
 	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
-	g_clear_pointer(&self->cached_high_res, gsk_render_node_unref);
+	g_clear_pointer(&self->high_res_tiles, g_hash_table_unref);
+	g_clear_handle_id(&self->generate_cache_source, g_source_remove);
+	g_clear_object(&self->memory_monitor);
 	G_OBJECT_CLASS(phi_view_parent_class)->dispose(object);
 }
 
@@ -70,6 +127,9 @@ static void phi_view_object_get_property(GObject* object, guint prop_id, GValue*
 		case PROP_NODE:
 			g_value_set_pointer(val, phi_view_get_node(self));
 			break;
+		case PROP_PAGE:
+			g_value_set_object(val, phi_view_get_page(self));
+			break;
 		case PROP_HIGH_RES_TIMEOUT:
 			g_value_set_uint(val, phi_view_get_high_res_timeout(self));
 			break;
@@ -86,6 +146,9 @@ static void phi_view_object_set_property(GObject* object, guint prop_id, const G
 		case PROP_NODE:
 			phi_view_set_node(self, g_value_get_pointer(val));
 			break;
+		case PROP_PAGE:
+			phi_view_set_page(self, g_value_get_object(val));
+			break;
 		case PROP_HIGH_RES_TIMEOUT:
 			phi_view_set_high_res_timeout(self, g_value_get_uint(val));
 			break;
@@ -97,44 +160,200 @@ static void phi_view_object_set_property(GObject* object, guint prop_id, const G
 	}
 }
 
+static void phi_view_get_visible_area(PhiView* self, graphene_rect_t* area) {
+	graphene_rect_init(area,
+		-self->x / self->scale,
+		-self->y / self->scale,
+		gtk_widget_get_width(GTK_WIDGET(self)) / self->scale,
+		gtk_widget_get_height(GTK_WIDGET(self)) / self->scale
+	);
+}
+
+static gboolean phi_view_has_content(PhiView* self) {
+	return self->node || self->page;
+}
+static void phi_view_get_content_bounds(PhiView* self, graphene_rect_t* bounds) {
+	if (self->node)
+		gsk_render_node_get_bounds(self->node, bounds);
+	else
+		*bounds = self->page_bounds;
+}
+
+static gboolean phi_view_get_visible_tiles(PhiView* self, gint zoom, gint* x0, gint* y0, gint* x1, gint* y1) {
+	graphene_rect_t area, bounds;
+	phi_view_get_visible_area(self, &area);
+	phi_view_get_content_bounds(self, &bounds);
+	if (!graphene_rect_intersection(&area, &bounds, &area))
+		return FALSE;
+
+	gdouble scale = phi_view_zoom_bucket_scale(zoom);
+	*x0 = (gint)floor(area.origin.x * scale / PHI_VIEW_TILE_SIZE);
+	*y0 = (gint)floor(area.origin.y * scale / PHI_VIEW_TILE_SIZE);
+	*x1 = (gint)ceil((area.origin.x + area.size.width) * scale / PHI_VIEW_TILE_SIZE);
+	*y1 = (gint)ceil((area.origin.y + area.size.height) * scale / PHI_VIEW_TILE_SIZE);
+	return TRUE;
+}
+
+static void phi_view_evict_tiles(PhiView* self, gint zoom, gint x0, gint y0, gint x1, gint y1, guint budget) {
+	gboolean over_budget = g_hash_table_size(self->high_res_tiles) > budget;
+
+	GHashTableIter iter;
+	PhiViewTileKey* key;
+	g_hash_table_iter_init(&iter, self->high_res_tiles);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&key, NULL)) {
+		// other zoom levels were only kept as placeholders until the current one covers the view
+		if (key->zoom != zoom)
+			g_hash_table_iter_remove(&iter);
+		else if (over_budget && (key->x < x0 || key->x >= x1 || key->y < y0 || key->y >= y1))
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+/* All missing tiles are rendered by a single pass over their bounding box,
+ * each tile then clips its part out of that texture. The texture is only
+ * freed once all of its tiles got evicted.
+ */
+static void phi_view_rasterize_tiles(PhiView* self, GskRenderNode* source, gint zoom, gint x0, gint y0, gint x1, gint y1) {
+	gint mx0 = x1, my0 = y1, mx1 = x0, my1 = y0;
+	for (gint y = y0; y < y1; y++) {
+		for (gint x = x0; x < x1; x++) {
+			PhiViewTileKey key = { .zoom = zoom, .x = x, .y = y };
+			if (g_hash_table_contains(self->high_res_tiles, &key))
+				continue;
+			mx0 = MIN(mx0, x);
+			my0 = MIN(my0, y);
+			mx1 = MAX(mx1, x + 1);
+			my1 = MAX(my1, y + 1);
+		}
+	}
+
+	if (mx0 < mx1 && my0 < my1) {
+		gdouble scale = phi_view_zoom_bucket_scale(zoom);
+		GskTransform* transform = gsk_transform_scale(NULL, scale, scale);
+		GskRenderNode* scaled = gsk_transform_node_new(source, transform);
+		gsk_transform_unref(transform);
+
+		graphene_rect_t area;
+		graphene_rect_init(&area,
+			mx0 * PHI_VIEW_TILE_SIZE, my0 * PHI_VIEW_TILE_SIZE,
+			(mx1 - mx0) * PHI_VIEW_TILE_SIZE, (my1 - my0) * PHI_VIEW_TILE_SIZE
+		);
+		GdkTexture* texture = gsk_renderer_render_texture(self->renderer, scaled, &area);
+		gsk_render_node_unref(scaled);
+
+		graphene_rect_t bounds;
+		graphene_rect_init(&bounds,
+			area.origin.x / scale, area.origin.y / scale,
+			area.size.width / scale, area.size.height / scale
+		);
+		GskRenderNode* rendered = gsk_texture_node_new(texture, &bounds);
+		g_object_unref(texture);
+
+		for (gint y = my0; y < my1; y++) {
+			for (gint x = mx0; x < mx1; x++) {
+				PhiViewTileKey key = { .zoom = zoom, .x = x, .y = y };
+				if (g_hash_table_contains(self->high_res_tiles, &key))
+					continue;
+
+				graphene_rect_t tile;
+				graphene_rect_init(&tile,
+					x * PHI_VIEW_TILE_SIZE / scale, y * PHI_VIEW_TILE_SIZE / scale,
+					PHI_VIEW_TILE_SIZE / scale, PHI_VIEW_TILE_SIZE / scale
+				);
+				g_hash_table_insert(self->high_res_tiles, g_memdup2(&key, sizeof key), gsk_clip_node_new(rendered, &tile));
+			}
+		}
+		gsk_render_node_unref(rendered);
+	}
+
+	phi_view_evict_tiles(self, zoom, x0, y0, x1, y1, PHI_VIEW_MAX_TILES);
+
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+typedef struct {
+	PhiView* view;
+	gint zoom;
+	gint x0, y0, x1, y1;
+} PhiViewTileRequest;
+
+static void phi_view_region_rendered(PhiPage* page, GAsyncResult* result, PhiViewTileRequest* request) {
+	GError* err = NULL;
+	GskRenderNode* source = phi_page_render_region_to_node_finish(page, result, &err);
+	if (!source) {
+		// the view may already be gone
+		if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to render page region: %s", err->message);
+		g_error_free(err);
+		g_free(request);
+		return;
+	}
+
+	PhiView* self = request->view;
+	g_clear_object(&self->tiles_cancellable);
+	if (self->renderer)
+		phi_view_rasterize_tiles(self, source, request->zoom, request->x0, request->y0, request->x1, request->y1);
+	gsk_render_node_unref(source);
+	g_free(request);
+}
+
 static void phi_view_regenerate_high_res_cache_cb(PhiView* self) {
 	self->generate_cache_source = 0;
-	if (!self->renderer)
+	if (!self->renderer || !phi_view_has_content(self))
 		return;
 
-	GskTransform *transform = gsk_transform_scale(
-		gsk_transform_translate(NULL, &GRAPHENE_POINT_INIT(self->x, self->y)),
-		self->scale, self->scale
-	);
+	gint zoom = phi_view_zoom_bucket(self->scale);
+	gint x0, y0, x1, y1;
+	if (!phi_view_get_visible_tiles(self, zoom, &x0, &y0, &x1, &y1))
+		return;
 
-	GskRenderNode* node;
-	if (transform) {
-		node = gsk_transform_node_new(self->node, transform);
-		gsk_transform_unref(transform);
-	} else {
-		node = gsk_render_node_ref(self->node);
+	gboolean missing = FALSE;
+	for (gint y = y0; y < y1 && !missing; y++) {
+		for (gint x = x0; x < x1 && !missing; x++) {
+			PhiViewTileKey key = { .zoom = zoom, .x = x, .y = y };
+			missing = !g_hash_table_contains(self->high_res_tiles, &key);
+		}
+	}
+	if (!missing) {
+		phi_view_evict_tiles(self, zoom, x0, y0, x1, y1, PHI_VIEW_MAX_TILES);
+		return;
 	}
 
-	graphene_rect_t view;
-	graphene_rect_init(&view,
-		0., 0.,
-		gtk_widget_get_width(GTK_WIDGET(self)),
-		gtk_widget_get_height(GTK_WIDGET(self))
-	);
+	if (self->node) {
+		phi_view_rasterize_tiles(self, self->node, zoom, x0, y0, x1, y1);
+		return;
+	}
 
-	GskRenderNode* clipped = gsk_clip_node_new(node, &view);
-	gsk_render_node_unref(node);
+	// a single conversion covering all visible tiles, the display list skips the rest of the page
+	gdouble scale = phi_view_zoom_bucket_scale(zoom);
+	graphene_rect_t region;
+	graphene_rect_init(&region,
+		x0 * PHI_VIEW_TILE_SIZE / scale, y0 * PHI_VIEW_TILE_SIZE / scale,
+		(x1 - x0) * PHI_VIEW_TILE_SIZE / scale, (y1 - y0) * PHI_VIEW_TILE_SIZE / scale
+	);
+	PhiViewTileRequest* request = g_new(PhiViewTileRequest, 1);
+	*request = (PhiViewTileRequest){ .view = self, .zoom = zoom, .x0 = x0, .y0 = y0, .x1 = x1, .y1 = y1 };
 
-	GdkTexture* texture = gsk_renderer_render_texture(self->renderer, clipped, &view);
-	self->cached_high_res = gsk_texture_node_new(texture, &view);
-	gsk_render_node_unref(clipped);
-	g_object_unref(texture);
+	if (self->tiles_cancellable) {
+		g_cancellable_cancel(self->tiles_cancellable);
+		g_object_unref(self->tiles_cancellable);
+	}
+	self->tiles_cancellable = g_cancellable_new();
+	phi_page_render_region_to_node_async(self->page, &region, self->tiles_cancellable, (GAsyncReadyCallback)phi_view_region_rendered, request);
+}
 
+static void phi_view_low_memory_warning(GMemoryMonitor*, GMemoryMonitorWarningLevel level, PhiView* self) {
+	gint zoom = phi_view_zoom_bucket(self->scale);
+	gint x0, y0, x1, y1;
+	if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL || !phi_view_has_content(self) || !phi_view_get_visible_tiles(self, zoom, &x0, &y0, &x1, &y1))
+		g_hash_table_remove_all(self->high_res_tiles);
+	else
+		phi_view_evict_tiles(self, zoom, x0, y0, x1, y1, 0);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
 static void phi_view_queue_regenerate_high_res_cache(PhiView* self) {
-	g_clear_pointer(&self->cached_high_res, gsk_render_node_unref);
+	// existing tiles keep being drawn until they are replaced
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 
 	if (self->generate_cache_source)
@@ -142,18 +361,11 @@ static void phi_view_queue_regenerate_high_res_cache(PhiView* self) {
 	self->generate_cache_source = g_timeout_add_once(250, (GSourceOnceFunc)phi_view_regenerate_high_res_cache_cb, self);
 }
 
-static void phi_view_regenerate_full_cache(PhiView* self) {
-	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
-
-	if (!self->renderer) {
-		self->cached_low_res = gsk_render_node_ref(self->node);
-		return;
-	}
-
+static void phi_view_set_overview(PhiView* self, GskRenderNode* source) {
 	graphene_rect_t view;
-	gsk_render_node_get_bounds(self->node, &view);
+	phi_view_get_content_bounds(self, &view);
 
-	GdkTexture* texture = gsk_renderer_render_texture(self->renderer, self->node, &view);
+	GdkTexture* texture = gsk_renderer_render_texture(self->renderer, source, &view);
 	self->cached_low_res = gsk_texture_node_new(texture, &view);
 	g_object_unref(texture);
 
@@ -162,6 +374,52 @@ static void phi_view_regenerate_full_cache(PhiView* self) {
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
+static void phi_view_overview_rendered(PhiPage* page, GAsyncResult* result, PhiView* self) {
+	GError* err = NULL;
+	GdkTexture* texture = phi_page_rasterize_finish(page, result, &err);
+	if (!texture) {
+		// the view may already be gone
+		if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to render page: %s", err->message);
+		g_error_free(err);
+		return;
+	}
+
+	g_clear_object(&self->overview_cancellable);
+	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
+	self->cached_low_res = gsk_texture_node_new(texture, &self->page_bounds);
+	g_object_unref(texture);
+
+	phi_view_queue_regenerate_high_res_cache(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void phi_view_regenerate_full_cache(PhiView* self) {
+	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
+
+	if (!self->renderer) {
+		if (self->node)
+			self->cached_low_res = gsk_render_node_ref(self->node);
+		return;
+	}
+
+	if (self->node) {
+		phi_view_set_overview(self, self->node);
+		return;
+	}
+
+	/* Drawn by MuPDF at one pixel per point: converting the whole page into
+	 * nodes would cost as much as showing it unzoomed, and the tiles only
+	 * convert the regions they cover.
+	 */
+	if (self->overview_cancellable) {
+		g_cancellable_cancel(self->overview_cancellable);
+		g_object_unref(self->overview_cancellable);
+	}
+	self->overview_cancellable = g_cancellable_new();
+	phi_page_rasterize_async(self->page, 1., self->overview_cancellable, (GAsyncReadyCallback)phi_view_overview_rendered, self);
+}
+
 static void phi_view_widget_realize(GtkWidget* widget) {
 	PhiView* self = PHI_VIEW(widget);
 	g_assert(self->renderer == NULL);
@@ -187,7 +445,8 @@ realize_cairo:
 		}
 	}
 
-	phi_view_regenerate_full_cache(self);
+	if (phi_view_has_content(self))
+		phi_view_regenerate_full_cache(self);
 }
 static void phi_view_widget_unrealize(GtkWidget* widget) {
 	PhiView* self = PHI_VIEW(widget);
@@ -196,6 +455,8 @@ static void phi_view_widget_unrealize(GtkWidget* widget) {
 		g_object_unref(self->renderer);
 		self->renderer = NULL;
 	}
+	if (self->high_res_tiles)
+		g_hash_table_remove_all(self->high_res_tiles);
 
 	GTK_WIDGET_CLASS(phi_view_parent_class)->unrealize(widget);
 }
@@ -207,7 +468,14 @@ static void phi_view_widget_size_allocate(GtkWidget* widget, G_GNUC_UNUSED int w
 
 static void phi_view_widget_snapshot(GtkWidget* widget, GtkSnapshot* snapshot) {
 	PhiView* self = PHI_VIEW(widget);
-	if (!self->node)
+	if (!phi_view_has_content(self))
+		return;
+
+	GskRenderer* current = gtk_native_get_renderer(gtk_widget_get_native(widget));
+	// The cairo renderer is generally a lot faster at drawing paths compared to sampling textures
+	gboolean direct = G_OBJECT_TYPE(current) == GSK_TYPE_CAIRO_RENDERER && self->node;
+	GskRenderNode* active = direct ? self->node : self->cached_low_res;
+	if (!active)
 		return;
 
 	if (self->inverted) {
@@ -218,22 +486,35 @@ static void phi_view_widget_snapshot(GtkWidget* widget, GtkSnapshot* snapshot) {
 		gtk_snapshot_push_color_matrix(snapshot, &mat, &off);
 	}
 
-	GskRenderNode* active = self->cached_high_res != NULL ? self->cached_high_res : self->cached_low_res;
-
-	GskRenderer* current = gtk_native_get_renderer(gtk_widget_get_native(widget));
-	// The cairo renderer is generally a lot faster at drawing paths compared to sampling textures
-	if (G_OBJECT_TYPE(current) == GSK_TYPE_CAIRO_RENDERER)
-		active = self->node;
-
-	if (active != self->cached_high_res) {
-		gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(self->x, self->y));
-		gtk_snapshot_scale(snapshot, self->scale, self->scale);
-	}
+	gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(self->x, self->y));
+	gtk_snapshot_scale(snapshot, self->scale, self->scale);
 
 	graphene_rect_t bounds;
 	gsk_render_node_get_bounds(active, &bounds);
 	gtk_snapshot_push_clip(snapshot, &bounds);
 	gtk_snapshot_append_node(snapshot, active);
+
+	if (!direct && g_hash_table_size(self->high_res_tiles) > 0) {
+		graphene_rect_t area;
+		phi_view_get_visible_area(self, &area);
+		gint zoom = phi_view_zoom_bucket(self->scale);
+
+		// tiles of stale zoom levels first, so the current level ends up on top
+		for (gint pass = 0; pass < 2; pass++) {
+			GHashTableIter iter;
+			PhiViewTileKey* key;
+			GskRenderNode* tile;
+			g_hash_table_iter_init(&iter, self->high_res_tiles);
+			while (g_hash_table_iter_next(&iter, (gpointer*)&key, (gpointer*)&tile)) {
+				if ((key->zoom == zoom) != (pass == 1))
+					continue;
+				graphene_rect_t tile_bounds;
+				gsk_render_node_get_bounds(tile, &tile_bounds);
+				if (graphene_rect_intersection(&tile_bounds, &area, NULL))
+					gtk_snapshot_append_node(snapshot, tile);
+			}
+		}
+	}
 	gtk_snapshot_pop(snapshot);
 
 	if (self->inverted)
@@ -253,6 +534,7 @@ static void phi_view_class_init(PhiViewClass* klass) {
 	widget_class->snapshot = phi_view_widget_snapshot;
 
 	obj_properties[PROP_NODE] = g_param_spec_pointer("node", NULL, NULL, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+	obj_properties[PROP_PAGE] = g_param_spec_object("page", NULL, NULL, PHI_TYPE_PAGE, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
 	obj_properties[PROP_HIGH_RES_TIMEOUT] = g_param_spec_uint("high-res-timeout", NULL, NULL, 10, 10000, 250, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
 	obj_properties[PROP_INVERTED] = g_param_spec_boolean("inverted", NULL, NULL, FALSE, G_PARAM_STATIC_STRINGS | G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
 	g_object_class_install_properties(object_class, N_PROPERTIES, obj_properties);
@@ -318,6 +600,11 @@ static void phi_view_init(PhiView* self) {
 	
 	self->pointer_x = NAN;
 	self->pointer_y = NAN;
+
+	self->high_res_tiles = g_hash_table_new_full((GHashFunc)phi_view_tile_key_hash, (GEqualFunc)phi_view_tile_key_equal, g_free, (GDestroyNotify)gsk_render_node_unref);
+
+	self->memory_monitor = g_memory_monitor_dup_default();
+	g_signal_connect_object(self->memory_monitor, "low-memory-warning", G_CALLBACK(phi_view_low_memory_warning), self, G_CONNECT_DEFAULT);
 	
 	GtkEventController* motion = gtk_event_controller_motion_new();
 	g_signal_connect(motion, "motion", G_CALLBACK(phi_view_motion_move), self);
@@ -349,7 +636,12 @@ void phi_view_set_node(PhiView* self, GskRenderNode* node) {
 	g_return_if_fail(PHI_IS_VIEW(self));
 	g_clear_pointer(&self->node, gsk_render_node_unref);
 	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
-	g_clear_pointer(&self->cached_high_res, gsk_render_node_unref);
+	g_hash_table_remove_all(self->high_res_tiles);
+	if (self->page) {
+		phi_view_cancel_conversions(self);
+		g_clear_object(&self->page);
+		g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_PAGE]);
+	}
 	if (node) {
 		self->node = gsk_render_node_ref(node);
 		phi_view_regenerate_full_cache(self);
@@ -358,6 +650,35 @@ void phi_view_set_node(PhiView* self, GskRenderNode* node) {
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
+PhiPage* phi_view_get_page(PhiView* self) {
+	g_return_val_if_fail(PHI_IS_VIEW(self), NULL);
+	return self->page;
+}
+
+/* Instead of converting the whole page into nodes, the view draws a low
+ * resolution overview with MuPDF and converts only the regions needed for
+ * the visible high resolution tiles. Both run asynchronously, the view
+ * stays responsive meanwhile.
+ */
+void phi_view_set_page(PhiView* self, PhiPage* page) {
+	g_return_if_fail(PHI_IS_VIEW(self));
+	g_return_if_fail(page == NULL || PHI_IS_PAGE(page));
+	g_clear_pointer(&self->cached_low_res, gsk_render_node_unref);
+	g_hash_table_remove_all(self->high_res_tiles);
+	phi_view_cancel_conversions(self);
+	if (self->node) {
+		g_clear_pointer(&self->node, gsk_render_node_unref);
+		g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_NODE]);
+	}
+	g_set_object(&self->page, page);
+	if (page) {
+		phi_page_get_bounds(page, &self->page_bounds);
+		phi_view_regenerate_full_cache(self);
+	}
+	g_object_notify_by_pspec(G_OBJECT(self), obj_properties[PROP_PAGE]);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
 guint phi_view_get_high_res_timeout(PhiView* self) {
 	g_return_val_if_fail(PHI_IS_VIEW(self), 0);
 	return self->high_res_timeout;
@@ -21,6 +21,8 @@
 
 #include <gtk/gtk.h>
 
+#include <phi/phipage.h>
+
 G_BEGIN_DECLS
 
 #define PHI_TYPE_VIEW (phi_view_get_type())
@@ -31,6 +33,9 @@ GtkWidget* phi_view_new(GskRenderNode* node);
 GskRenderNode* phi_view_get_node(PhiView* self);
 void phi_view_set_node(PhiView* self, GskRenderNode* node);
 
+PhiPage* phi_view_get_page(PhiView* self);
+void phi_view_set_page(PhiView* self, PhiPage* page);
+
 guint phi_view_get_high_res_timeout(PhiView* self);
 void phi_view_set_high_res_timeout(PhiView* self, guint timeout);
 
@@ -19,34 +19,37 @@
 #include <gtk/gtk.h>
 
 #include <phi/phidocument.h>
-#include <phi/phiview.h>
+#include <phi/phidocumentview.h>
+
+static void app_document_loaded(GObject*, GAsyncResult* res, gpointer user_data) {
+	PhiDocumentView* view = PHI_DOCUMENT_VIEW(user_data);
+
+	GError* err = NULL;
+	PhiDocument* doc = phi_document_new_from_file_finish(res, &err);
+	if (err)
+		g_error("Failed loading document: %s", err->message);
+
+	phi_document_view_set_document(view, doc);
+	g_object_unref(doc);
+	g_object_unref(view);
+}
 
 static void app_open(GtkApplication* app, GFile** files, gint n_files, gchar*, gpointer) {
 	if (n_files != 1)
 		g_error("Expected one file");
 
 	GtkWidget *window = gtk_application_window_new(app);	
-	
-	GError* err = NULL;
-	PhiDocument* doc = phi_document_new_from_file(files[0], &err);
-	if (err)
-		g_error("Failed loading document: %s", err->message);
-	PhiPage* page = phi_document_get_page(doc, 0, &err);
-	if (err)
-		g_error("Failed loading page: %s", err->message);
-	GskRenderNode* node = phi_page_render_to_node(page, &err);
-	if (err)
-		g_error("Failed to render to node: %s", err->message);
 
-	GtkWidget* view = phi_view_new(node);
-	gtk_widget_set_hexpand(view, TRUE);
-	gtk_widget_set_vexpand(view, TRUE);
-	gtk_widget_set_overflow(view, GTK_OVERFLOW_HIDDEN);
+	GtkWidget* view = phi_document_view_new(NULL);
+	phi_document_new_from_file_async(files[0], NULL, NULL, NULL, app_document_loaded, g_object_ref(view));
 
-	g_object_unref (page);
-	gsk_render_node_unref (node);
+	GtkWidget* scroller = gtk_scrolled_window_new();
+	gtk_widget_set_hexpand(scroller, TRUE);
+	gtk_widget_set_vexpand(scroller, TRUE);
+	gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scroller), view);
 
-	gtk_window_set_child(GTK_WINDOW(window), view);
+	gtk_window_set_child(GTK_WINDOW(window), scroller);
+	gtk_window_set_default_size(GTK_WINDOW(window), 800, 1000);
 	gtk_window_present(GTK_WINDOW(window));
 }
 